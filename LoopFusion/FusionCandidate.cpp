@@ -1,25 +1,177 @@
 #include "FusionCandidate.h"
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/Support/Debug.h"
 
 #define DEBUG_TYPE "loop-fusion"
 
+// Maximum number of pointer variables followed when looking for the object a
+// pointer points into.
+static constexpr unsigned MaxObjectLookup = 6;
+
+static thread_local raw_ostream *FusionLog = nullptr;
+
+auto fusionLog() -> raw_ostream & { return FusionLog ? *FusionLog : dbgs(); }
+
+void setFusionLog(raw_ostream *OS) { FusionLog = OS; }
+
+auto getVariableInitializer(const AllocaInst *Variable) -> const Value * {
+  const StoreInst *Initializer = nullptr;
+  for (const User *U : Variable->users()) {
+    if (isa<LoadInst>(U)) {
+      continue;
+    }
+    const StoreInst *Store = dyn_cast<StoreInst>(U);
+    if (!Store || Store->getPointerOperand() != Variable || Initializer) {
+      return nullptr;
+    }
+    Initializer = Store;
+  }
+  return Initializer ? Initializer->getValueOperand() : nullptr;
+}
+
+auto getAccessedObject(const Value *Pointer) -> const Value * {
+  const Value *Object = getUnderlyingObject(Pointer);
+  for (unsigned Lookup = 0; Lookup < MaxObjectLookup; ++Lookup) {
+    const LoadInst *Load = dyn_cast<LoadInst>(Object);
+    if (!Load) {
+      break;
+    }
+    const AllocaInst *Variable =
+        dyn_cast<AllocaInst>(Load->getPointerOperand());
+    if (!Variable) {
+      break;
+    }
+    const Value *Initializer = getVariableInitializer(Variable);
+    if (!Initializer) {
+      break;
+    }
+    Object = getUnderlyingObject(Initializer);
+  }
+  return Object;
+}
+
+/// Returns the stack or global std::vector `V` if the object is a call to
+/// `V.data()`, and nullptr otherwise.
+static auto getVectorOfBuffer(const Value *Object) -> const Value * {
+  const CallBase *Call = dyn_cast_or_null<CallBase>(Object);
+  const Function *Callee = Call ? Call->getCalledFunction() : nullptr;
+  if (!Callee || Call->arg_size() != 1) {
+    return nullptr;
+  }
+  // std::vector<T>::data() and its const overload, as mangled for libstdc++
+  // (std::vector) and libc++ (std::__1::vector).
+  StringRef Name = Callee->getName();
+  if (!Name.startswith("_ZN") || !Name.endswith("4dataEv") ||
+      (!Name.contains("St6vector") && !Name.contains("St3__16vector"))) {
+    return nullptr;
+  }
+  const Value *Vector = getUnderlyingObject(Call->getArgOperand(0));
+  return isa<AllocaInst>(Vector) || isa<GlobalVariable>(Vector) ? Vector
+                                                                 : nullptr;
+}
+
+/// Returns the allocation the object stands for, if it is one that cannot
+/// overlap with any other allocation. The buffer of a std::vector stands for
+/// the vector, so that the buffers of two vectors are told apart and all
+/// pointers returned by data() of the same vector are the same allocation.
+/// This assumes no buffer is moved to another vector between the calls.
+static auto getDistinctAllocation(const Value *Object) -> const Value * {
+  if (isIdentifiedObject(Object)) {
+    return Object;
+  }
+  return getVectorOfBuffer(Object);
+}
+
+auto LoopAccess::get(Value *Pointer, Type *AccessType, const DataLayout &DL)
+    -> LoopAccess {
+  LocationSize Size = LocationSize::precise(DL.getTypeStoreSize(AccessType));
+  // An access indexed by the loop may touch any element of the array it
+  // indexes into, or anything around the pointer for plain pointer arithmetic.
+  while (GEPOperator *GEP = dyn_cast<GEPOperator>(Pointer)) {
+    if (GEP->hasAllConstantIndices()) {
+      break;
+    }
+    ConstantInt *FirstIndex = dyn_cast<ConstantInt>(GEP->getOperand(1));
+    if (FirstIndex && FirstIndex->isZero()) {
+      Size = LocationSize::precise(
+          DL.getTypeStoreSize(GEP->getSourceElementType()));
+    } else {
+      Size = LocationSize::beforeOrAfterPointer();
+    }
+    Pointer = GEP->getPointerOperand();
+  }
+  return {MemoryLocation(Pointer, Size), getAccessedObject(Pointer)};
+}
+
+auto LoopAccess::getForArgument(Value *Pointer) -> LoopAccess {
+  return {MemoryLocation::getBeforeOrAfter(Pointer),
+          getAccessedObject(Pointer)};
+}
+
+auto LoopAccess::getUnknown() -> LoopAccess {
+  return {MemoryLocation(), nullptr};
+}
+
+auto LoopAccess::mayAlias(const LoopAccess &Other, AAResults &AA) const
+    -> bool {
+  // Calls that may access any memory still cannot reach local variables whose
+  // address never escapes, such as loop counters.
+  if (!Object || !Other.Object) {
+    const Value *Known = Object ? Object : Other.Object;
+    return !Known || !isa<AllocaInst>(Known) ||
+           PointerMayBeCaptured(Known, /*ReturnCaptures=*/true,
+                                /*StoreCaptures=*/true);
+  }
+  // Distinct allocations never overlap, even when AA cannot tell because the
+  // pointers to them are loaded from local variables.
+  const Value *Allocation = getDistinctAllocation(Object);
+  const Value *OtherAllocation = getDistinctAllocation(Other.Object);
+  if (Allocation && OtherAllocation && Allocation != OtherAllocation) {
+    return false;
+  }
+  return !AA.isNoAlias(Location, Other.Location);
+}
+
+/// Checks if a call can be reordered with the rest of the loops. The callee
+/// has to return normally and must not write to memory other than the memory
+/// its pointer arguments point to.
+static auto isFusableCall(const CallBase *Call) -> bool {
+  if (!Call->doesNotThrow() || !Call->willReturn()) {
+    return false;
+  }
+  return Call->onlyReadsMemory() || Call->onlyAccessesArgMemory();
+}
+
 auto FusionCandidate::isCandidateForFusion() const -> bool {
   for (auto &BB : L->getBlocks()) {
     for (auto &Inst : *BB) {
+      if (CallBase *Call = dyn_cast<CallBase>(&Inst)) {
+        if (!isFusableCall(Call)) {
+          fusionLog() << "Loop contains call that may throw exception or "
+                         "has unknown side effects.\n";
+          return false;
+        }
+        continue;
+      }
       if (Inst.mayThrow()) {
-        dbgs() << "Loop contains instruction that may throw exception.\n";
+        fusionLog() << "Loop contains instruction that may throw exception.\n";
         return false;
       }
       if (StoreInst *Store = dyn_cast<StoreInst>(&Inst)) {
         if (Store->isVolatile()) {
-          dbgs() << "Loop contains volatile memory access.\n";
+          fusionLog() << "Loop contains volatile memory access.\n";
           return false;
         }
       }
       if (LoadInst *Load = dyn_cast<LoadInst>(&Inst)) {
         if (Load->isVolatile()) {
-          dbgs() << "Loop contains volatile memory access.\n";
+          fusionLog() << "Loop contains volatile memory access.\n";
           return false;
         }
       }
@@ -27,24 +179,24 @@ auto FusionCandidate::isCandidateForFusion() const -> bool {
   }
 
   if (!L->isLoopSimplifyForm()) {
-    dbgs() << "Loop is not in simplified form.\n";
+    fusionLog() << "Loop is not in simplified form.\n";
     return false;
   }
 
   if (!L->getLoopPreheader() || !L->getHeader() || !L->getExitingBlock() ||
       !L->getLoopLatch()) {
-    dbgs() << "Necessary loop information is not available(preheader, header, "
-              "latch, exiting block).\n";
+    fusionLog() << "Necessary loop information is not available(preheader, "
+                   "header, latch, exiting block).\n";
     return false;
   }
 
   if (!hasSingleEntryPoint() || !hasSingleExitPoint()) {
-    dbgs() << "Loop does not have single entry or exit point.\n";
+    fusionLog() << "Loop does not have single entry or exit point.\n";
     return false;
   }
 
   if (L->isAnnotatedParallel()) {
-    dbgs() << "Loop is annotated parallel.\n";
+    fusionLog() << "Loop is annotated parallel.\n";
     return false;
   }
 
@@ -67,54 +219,77 @@ auto FusionCandidate::hasSingleExitPoint() const -> bool {
 }
 
 void FusionCandidate::setLoopVariables() {
-  Value *ArrayValue;
-  bool WasArray = false;
-  bool FirstHeaderLoad = true;
-  BasicBlock *Header = L->getHeader();
+  const DataLayout &DL = Header->getModule()->getDataLayout();
   for (BasicBlock *BB : L->getBlocks()) {
-    if (BB == Header) {
-      for (Instruction &Instr : *BB) {
-        if (isa<LoadInst>(&Instr)) {
-          if (FirstHeaderLoad) {
-            WriteVariables.push_back(Instr.getOperand(0));
-            FirstHeaderLoad = false;
-            continue;
-          }
-          ReadVariables.push_back(Instr.getOperand(0));
-        }
+    for (Instruction &Instr : *BB) {
+      if (LoadInst *Load = dyn_cast<LoadInst>(&Instr)) {
+        ReadAccesses.push_back(
+            LoopAccess::get(Load->getPointerOperand(), Load->getType(), DL));
       }
-    }
-    if (BB != Header && !L->isLoopLatch(BB) && !L->isLoopExiting(BB)) {
-      for (Instruction &Instr : *BB) {
-        if (isa<LoadInst>(&Instr)) {
-          if (WasArray) {
-            ReadVariables.push_back(ArrayValue);
-            WasArray = false;
-            continue;
-          }
-          ReadVariables.push_back(Instr.getOperand(0));
-        }
-        if (isa<StoreInst>(&Instr)) {
-          if (WasArray) {
-            WriteVariables.push_back(ArrayValue);
-            WasArray = false;
-            continue;
-          }
-          WriteVariables.push_back(Instr.getOperand(1));
-        }
-        if (isa<GetElementPtrInst>(&Instr)) {
-          ArrayValue = (Instr.getOperand(0));
-          WasArray = true;
-        }
+      if (StoreInst *Store = dyn_cast<StoreInst>(&Instr)) {
+        WriteAccesses.push_back(
+            LoopAccess::get(Store->getPointerOperand(),
+                            Store->getValueOperand()->getType(), DL));
+      }
+      if (CallBase *Call = dyn_cast<CallBase>(&Instr)) {
+        addCallAccesses(Call);
       }
     }
   }
 }
 
-std::vector<Value *> FusionCandidate::getReadVariables() {
-  return ReadVariables;
+/// Folds the memory effects of a call, as described by its attributes, into
+/// the accesses of the loop.
+void FusionCandidate::addCallAccesses(CallBase *Call) {
+  if (isa<DbgInfoIntrinsic>(Call) || Call->isLifetimeStartOrEnd() ||
+      Call->doesNotAccessMemory()) {
+    return;
+  }
+  if (!Call->onlyAccessesArgMemory()) {
+    ReadAccesses.push_back(LoopAccess::getUnknown());
+    if (!Call->onlyReadsMemory()) {
+      WriteAccesses.push_back(LoopAccess::getUnknown());
+    }
+    return;
+  }
+
+  for (unsigned ArgNo = 0; ArgNo < Call->arg_size(); ++ArgNo) {
+    Value *Arg = Call->getArgOperand(ArgNo);
+    if (!Arg->getType()->isPointerTy() || Call->doesNotAccessMemory(ArgNo)) {
+      continue;
+    }
+    ReadAccesses.push_back(LoopAccess::getForArgument(Arg));
+    if (!Call->onlyReadsMemory() && !Call->onlyReadsMemory(ArgNo)) {
+      WriteAccesses.push_back(LoopAccess::getForArgument(Arg));
+    }
+  }
+}
+
+auto FusionCandidate::mayWriteTo(const LoopAccess &Access,
+                                 AAResults &AA) const -> bool {
+  for (const LoopAccess &Write : WriteAccesses) {
+    if (Write.mayAlias(Access, AA)) {
+      return true;
+    }
+  }
+  return false;
 }
 
-std::vector<Value *> FusionCandidate::getWriteVariables() {
-  return WriteVariables;
-}
\ No newline at end of file
+auto FusionCandidate::getBytesAccessedPerIteration() const -> uint64_t {
+  const DataLayout &DL = Header->getModule()->getDataLayout();
+  uint64_t Bytes = 0;
+  for (BasicBlock *BB : L->getBlocks()) {
+    if (BB == Header || L->isLoopLatch(BB)) {
+      continue;
+    }
+    for (Instruction &Instr : *BB) {
+      Value *Pointer = getLoadStorePointerOperand(&Instr);
+      if (!Pointer || isa<AllocaInst>(Pointer)) {
+        continue;
+      }
+      Type *AccessType = getLoadStoreType(&Instr);
+      Bytes += DL.getTypeStoreSize(AccessType).getFixedSize();
+    }
+  }
+  return Bytes;
+}
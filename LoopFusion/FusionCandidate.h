@@ -1,10 +1,60 @@
 #ifndef LIB_FUSIONCANDIDATE_H
 #define LIB_FUSIONCANDIDATE_H
 
+#include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Support/raw_ostream.h"
 
 using namespace llvm;
 
+/// Returns the stream the passes print the checks they do to, which is
+/// dbgs() unless the current thread redirected it with setFusionLog.
+auto fusionLog() -> raw_ostream &;
+
+/// Redirects fusionLog() of the current thread, e.g. to nulls() when the
+/// passes run on a thread pool. nullptr restores dbgs().
+void setFusionLog(raw_ostream *OS);
+
+/// Returns the only value ever stored to a local variable, or nullptr if the
+/// variable is written more than once or its address escapes.
+auto getVariableInitializer(const AllocaInst *Variable) -> const Value *;
+
+/// Finds the object a pointer points into. At -O0 pointers to heap memory
+/// (`float *P = new float[N]`, `float *P = V.data()`) live in local variables,
+/// so a load from a variable that is written exactly once is followed to the
+/// value the variable was initialized with.
+///
+/// The buffer of a `std::vector` is the `V.data()` call that returned it, and
+/// LoopAccess::mayAlias tells buffers of different vectors apart. Loops
+/// indexing vectors with `V[i]` call `operator[]` and are not candidates.
+auto getAccessedObject(const Value *Pointer) -> const Value *;
+
+/// Memory read or written by a load, a store or a call inside of a loop.
+struct LoopAccess {
+  /// Location of the access. Accesses indexed by the loop counter are widened
+  /// to the whole array or struct field they index into.
+  MemoryLocation Location;
+  /// Object the accessed memory belongs to (stack or global array, heap
+  /// allocation, ...). Pointers kept in local variables are followed to the
+  /// value they were initialized with. It is nullptr for calls that may
+  /// access any memory.
+  const Value *Object;
+
+  static auto get(Value *Pointer, Type *AccessType, const DataLayout &DL)
+      -> LoopAccess;
+
+  /// Access of a call to the memory its pointer argument points to. Only the
+  /// object is known, not which part of it the callee accesses.
+  static auto getForArgument(Value *Pointer) -> LoopAccess;
+
+  /// Access of a call that may touch any memory.
+  static auto getUnknown() -> LoopAccess;
+
+  /// Checks if two accesses may touch the same memory.
+  auto mayAlias(const LoopAccess &Other, AAResults &AA) const -> bool;
+};
+
 /// Class used to represent a fusion candidate.
 class FusionCandidate {
 public:
@@ -28,18 +78,31 @@ public:
   inline auto getLatch() const -> BasicBlock * { return Latch; };
 
   void setLoopVariables();
-  std::vector<Value *> getWriteVariables();
-  std::vector<Value *> getReadVariables();
+  auto getWriteAccesses() const -> const std::vector<LoopAccess> & {
+    return WriteAccesses;
+  };
+  auto getReadAccesses() const -> const std::vector<LoopAccess> & {
+    return ReadAccesses;
+  };
+
+  /// Checks if the loop may write to the memory of the given access.
+  auto mayWriteTo(const LoopAccess &Access, AAResults &AA) const -> bool;
+
+  /// Estimates the number of bytes a single iteration of the loop body reads
+  /// and writes. Accesses to scalar stack slots (loop counters, locals) are
+  /// not counted since they end up in registers.
+  auto getBytesAccessedPerIteration() const -> uint64_t;
 
 private:
   auto hasSingleEntryPoint() const -> bool;
   auto hasSingleExitPoint() const -> bool;
+  void addCallAccesses(CallBase *Call);
 
   // Loop that represents a fusion candidate
   Loop *L;
 
-  std::vector<Value *> WriteVariables;
-  std::vector<Value *> ReadVariables;
+  std::vector<LoopAccess> WriteAccesses;
+  std::vector<LoopAccess> ReadAccesses;
   BasicBlock *Preheader;
   BasicBlock *Header;
   BasicBlock *ExitingBlock;
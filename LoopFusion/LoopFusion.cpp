@@ -1,24 +1,64 @@
 #include "FusionCandidate.h"
 #include "assert.h"
+#include "llvm/ADT/MapVector.h"
 #include "llvm/Analysis/DependenceAnalysis.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/LoopNestAnalysis.h"
 #include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/LoopPassManager.h"
 #include "llvm/Transforms/Utils.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/CodeMoverUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/Utils/LoopSimplify.h"
+#include <optional>
 
 using namespace llvm;
 
+static cl::opt<bool> EnableTiledFusion(
+    "loop-fusion-tile", cl::init(false),
+    cl::desc("Fuse loops tile by tile when the data they access does not fit "
+             "into the L1 data cache"));
+
+static cl::opt<unsigned> TileSizeOverride(
+    "loop-fusion-tile-size", cl::init(0),
+    cl::desc("Number of iterations per tile used by tiled fusion (0 derives "
+             "it from the L1 data cache size)"));
+
+static cl::opt<std::string> ReportFilename(
+    "loop-fusion-report", cl::value_desc("filename"),
+    cl::desc("Append a JSON line per function with the checks done for every "
+             "pair of fusion candidates to the file"));
+
+static cl::opt<bool> InstrumentLoops(
+    "loop-fusion-instrument", cl::init(false),
+    cl::desc("Count the cycles and iterations of fused loops and of loops of "
+             "rejected candidate pairs at runtime"));
+
+static cl::opt<bool> DryRun(
+    "loop-fusion-dry-run", cl::init(false),
+    cl::desc("Check and report candidate pairs without changing the loops, "
+             "e.g. to instrument an unfused baseline"));
+
+// Used when the target does not report the size of its L1 data cache.
+static constexpr unsigned DefaultCacheSize = 32 * 1024;
+
 namespace {
 
 using FusionCandidatesTy = SmallVector<FusionCandidate>;
@@ -26,10 +66,25 @@ using FusionCandidatesTy = SmallVector<FusionCandidate>;
 // ordered in respect to their dominance order.
 using CFESetsTy = SmallVector<std::set<FusionCandidate>>;
 
+/// Code measured by -loop-fusion-instrument. It is entered through the
+/// preheader of First and left through the exit of Last. Its trips are the
+/// iterations of the Counted loops, which run the body of the first of the
+/// original loops, so a fused pair and the same pair left unfused count the
+/// same trips.
+struct InstrumentedRegion {
+  Loop *First;
+  Loop *Last;
+  SmallVector<Loop *, 2> Counted;
+  std::string Location;
+  StringRef Status;
+};
+
 struct LoopFusion : public FunctionPass {
   FusionCandidatesTy FusionCandidates;
   std::unordered_map<Value *, Value *> VariablesMap;
   CFESetsTy CFESets;
+  // Code measured by -loop-fusion-instrument, by the first loop in it.
+  MapVector<Loop *, InstrumentedRegion> InstrumentedRegions;
   static char ID; // Pass identification, replacement for typeid
 
   LoopFusion() : FunctionPass(ID) {}
@@ -255,42 +310,806 @@ struct LoopFusion : public FunctionPass {
            !changesCounter(L2);
   }
 
-  bool areDependent(FusionCandidate *F1, FusionCandidate *F2) {
-    std::vector<Value *> ReadVariables1 = F1->getReadVariables();
-    std::vector<Value *> ReadVariables2 = F2->getReadVariables();
-    std::vector<Value *> WriteVariables1 = F1->getWriteVariables();
-    std::vector<Value *> WriteVariables2 = F2->getWriteVariables();
+  /// Returns the value the loop counter is initialized with before the loop.
+  Value *getStartValue(Loop *L) {
+    BasicBlock *PreLoop = L->getLoopPredecessor();
+    if (!PreLoop) {
+      return nullptr;
+    }
+    Value *StartValue = nullptr;
+    for (Instruction &Instr : *PreLoop) {
+      if (StoreInst *Store = dyn_cast<StoreInst>(&Instr)) {
+        // Last store value will always be the loop counter start value.
+        StartValue = Store->getValueOperand();
+      }
+    }
+    return StartValue;
+  }
+
+  /// Returns the comparison of the loop counter with the loop bound.
+  ICmpInst *getBoundCompare(Loop *L) {
+    for (Instruction &Instr : *L->getHeader()) {
+      if (ICmpInst *Cmp = dyn_cast<ICmpInst>(&Instr)) {
+        return Cmp;
+      }
+    }
+    return nullptr;
+  }
 
-    for (Value *V1 : WriteVariables1) {
-      for (Value *V2 : ReadVariables2) {
-        // dbgs() << "VALUE 1: " << V1 << ", VALUE 2: "  << V2 << '\n';
-        if (V1 == V2) {
-          return true;
+  /// Returns the instruction that increments the loop counter.
+  BinaryOperator *getStepOperation(Loop *L) {
+    BinaryOperator *Step = nullptr;
+    if (BasicBlock *Latch = L->getLoopLatch()) {
+      for (Instruction &Instr : *Latch) {
+        if (BinaryOperator *BinOp = dyn_cast<BinaryOperator>(&Instr)) {
+          Step = BinOp;
         }
       }
-      for (Value *V2 : WriteVariables2) {
-        // dbgs() << "VALUE 1: " << V1 << ", VALUE 2: "  << V2 << '\n';
-        if (V1 == V2) {
-          return true;
+    }
+    return Step;
+  }
+
+  /// Returns the memory location of the loop counter.
+  Value *getCounter(Loop *L) {
+    ICmpInst *Cmp = getBoundCompare(L);
+    if (!Cmp) {
+      return nullptr;
+    }
+    if (LoadInst *Load = dyn_cast<LoadInst>(Cmp->getOperand(0))) {
+      return Load->getPointerOperand();
+    }
+    return nullptr;
+  }
+
+  /// Returns the constant a value is known to have. At -O0 a bound like `n`
+  /// in `int n = 100; ... i < n` is a load of a local variable, which is
+  /// followed to the constant the variable was initialized with.
+  std::optional<int64_t> getConstantValue(const Value *V) {
+    bool ZeroExtended = isa_and_nonnull<ZExtInst>(V);
+    if (isa_and_nonnull<ZExtInst>(V) || isa_and_nonnull<SExtInst>(V)) {
+      V = cast<CastInst>(V)->getOperand(0);
+    }
+    if (const LoadInst *Load = dyn_cast_or_null<LoadInst>(V)) {
+      const AllocaInst *Variable =
+          dyn_cast<AllocaInst>(Load->getPointerOperand());
+      V = Variable ? getVariableInitializer(Variable) : nullptr;
+    }
+    const ConstantInt *Value = dyn_cast_or_null<ConstantInt>(V);
+    if (!Value) {
+      return std::nullopt;
+    }
+    return ZeroExtended ? Value->getZExtValue() : Value->getSExtValue();
+  }
+
+  /// Computes the trip count of a loop whose start value, bound and step are
+  /// constants or variables initialized with constants, see
+  /// getConstantValue. Returns std::nullopt if any of them is not known at
+  /// compile time.
+  std::optional<int64_t> getConstantTripCount(Loop *L) {
+    std::optional<int64_t> Start = getConstantValue(getStartValue(L));
+    ICmpInst *Cmp = getBoundCompare(L);
+    BinaryOperator *Step = getStepOperation(L);
+    if (!Start || !Cmp || !Step || Step->getOpcode() != Instruction::Add) {
+      return std::nullopt;
+    }
+    std::optional<int64_t> Bound = getConstantValue(Cmp->getOperand(1));
+    ConstantInt *StepValue = dyn_cast<ConstantInt>(Step->getOperand(1));
+    if (!Bound || !StepValue || StepValue->getSExtValue() <= 0) {
+      return std::nullopt;
+    }
+
+    int64_t Distance = *Bound - *Start;
+    switch (Cmp->getPredicate()) {
+    case CmpInst::ICMP_SLT:
+    case CmpInst::ICMP_ULT:
+      break;
+    case CmpInst::ICMP_SLE:
+    case CmpInst::ICMP_ULE:
+      Distance += 1;
+      break;
+    default:
+      return std::nullopt;
+    }
+    if (Distance <= 0) {
+      return 0;
+    }
+    return (Distance + StepValue->getSExtValue() - 1) /
+           StepValue->getSExtValue();
+  }
+
+  bool areDependent(FusionCandidate *F1, FusionCandidate *F2,
+                    AAResults &AA) {
+    for (const LoopAccess &Write : F1->getWriteAccesses()) {
+      if (F2->mayWriteTo(Write, AA)) {
+        return true;
+      }
+    }
+    for (const LoopAccess &Read : F1->getReadAccesses()) {
+      if (F2->mayWriteTo(Read, AA)) {
+        return true;
+      }
+    }
+    for (const LoopAccess &Read : F2->getReadAccesses()) {
+      if (F1->mayWriteTo(Read, AA)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// Checks if the loops have the shape tiled fusion and index set splitting
+  /// can transform: both count upwards with a constant step towards a bound
+  /// that is a constant or a variable not written inside of the loops.
+  /// Bounds are shared between the loops, so their counters have to be of
+  /// the same type, e.g. not an `int` and a `long`.
+  bool haveCanonicalShape(FusionCandidate *L1, FusionCandidate *L2,
+                          AAResults &AA) {
+    const DataLayout &DL = L1->getHeader()->getModule()->getDataLayout();
+    ICmpInst *L1Cmp = getBoundCompare(L1->getLoop());
+    ICmpInst *L2Cmp = getBoundCompare(L2->getLoop());
+    if (!L1Cmp || !L2Cmp ||
+        L1Cmp->getOperand(0)->getType() != L2Cmp->getOperand(0)->getType()) {
+      return false;
+    }
+    for (FusionCandidate *FC : {L1, L2}) {
+      Loop *L = FC->getLoop();
+      ICmpInst *Cmp = getBoundCompare(L);
+      BinaryOperator *Step = getStepOperation(L);
+      if (!Cmp || !Step || !getCounter(L) || !getStartValue(L)) {
+        return false;
+      }
+      if (Cmp->getPredicate() != CmpInst::ICMP_SLT &&
+          Cmp->getPredicate() != CmpInst::ICMP_ULT) {
+        return false;
+      }
+      if (Step->getOpcode() != Instruction::Add ||
+          !isa<ConstantInt>(Step->getOperand(1)) ||
+          cast<ConstantInt>(Step->getOperand(1))->getSExtValue() <= 0) {
+        return false;
+      }
+      if (FC->getExitingBlock() != FC->getHeader() ||
+          isa<PHINode>(FC->getExitBlock()->begin())) {
+        return false;
+      }
+      Value *Bound = Cmp->getOperand(1);
+      if (isa<ConstantInt>(Bound)) {
+        continue;
+      }
+      if (!isa<LoadInst>(Bound)) {
+        return false;
+      }
+      LoopAccess BoundAccess =
+          LoopAccess::get(VariablesMap[Bound], Bound->getType(), DL);
+      if (L1->mayWriteTo(BoundAccess, AA) || L2->mayWriteTo(BoundAccess, AA)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Checks if loops that differ only in their bounds can be fused by
+  /// splitting their index sets at runtime, see fuseLoopsSplit.
+  bool canSplitIndexSet(FusionCandidate *FC1, FusionCandidate *FC2,
+                        AAResults &AA) {
+    Loop *L1 = FC1->getLoop();
+    Loop *L2 = FC2->getLoop();
+    if (!haveSameStartValue(L1, L2) || !haveSameLatchValue(L1, L2) ||
+        changesCounter(L1) || changesCounter(L2)) {
+      return false;
+    }
+    // Remainder loops are plain copies of the loop blocks.
+    if (!L1->isInnermost() || !L2->isInnermost()) {
+      return false;
+    }
+    return haveCanonicalShape(FC1, FC2, AA) &&
+           getBoundCompare(L1)->getPredicate() ==
+               getBoundCompare(L2)->getPredicate();
+  }
+
+  /// Describes a value computed at -O0 as a variable plus a constant, e.g.
+  /// `n - 1` is {n, -1} and `5` is {nullptr, 5}. Returns std::nullopt for
+  /// anything more complex.
+  std::optional<std::pair<Value *, int64_t>> getVariableOffset(Value *V) {
+    if (ConstantInt *ConstInt = dyn_cast<ConstantInt>(V)) {
+      return std::make_pair(nullptr, ConstInt->getSExtValue());
+    }
+    if (LoadInst *Load = dyn_cast<LoadInst>(V)) {
+      return std::make_pair(Load->getPointerOperand(), 0);
+    }
+    BinaryOperator *BinOp = dyn_cast<BinaryOperator>(V);
+    if (!BinOp || !isa<ConstantInt>(BinOp->getOperand(1))) {
+      return std::nullopt;
+    }
+    auto Base = getVariableOffset(BinOp->getOperand(0));
+    int64_t Offset = cast<ConstantInt>(BinOp->getOperand(1))->getSExtValue();
+    if (!Base) {
+      return std::nullopt;
+    }
+    switch (BinOp->getOpcode()) {
+    case Instruction::Add:
+      Base->second += Offset;
+      return Base;
+    case Instruction::Sub:
+      Base->second -= Offset;
+      return Base;
+    default:
+      return std::nullopt;
+    }
+  }
+
+  /// Returns the constant the loop counter is incremented by in every
+  /// iteration, or std::nullopt if it is not a constant.
+  std::optional<int64_t> getConstantStep(Loop *L) {
+    BinaryOperator *Step = getStepOperation(L);
+    if (!Step || !isa<ConstantInt>(Step->getOperand(1))) {
+      return std::nullopt;
+    }
+    int64_t Value = cast<ConstantInt>(Step->getOperand(1))->getSExtValue();
+    switch (Step->getOpcode()) {
+    case Instruction::Add:
+      return Value;
+    case Instruction::Sub:
+      return -Value;
+    default:
+      return std::nullopt;
+    }
+  }
+
+  /// Checks if a local variable is private to every iteration of the loop:
+  /// it is only used inside of the loop and always written before it is read
+  /// in the same iteration, like variables declared in the loop body.
+  bool isLoopPrivate(Value *Pointer, Loop *L, DominatorTree &DT) {
+    if (!isa<AllocaInst>(Pointer)) {
+      return false;
+    }
+    SmallVector<StoreInst *> Stores;
+    SmallVector<LoadInst *> Loads;
+    for (User *U : Pointer->users()) {
+      Instruction *Instr = cast<Instruction>(U);
+      if (!L->contains(Instr) || getLoadStorePointerOperand(Instr) != Pointer) {
+        return false;
+      }
+      if (StoreInst *Store = dyn_cast<StoreInst>(Instr)) {
+        Stores.push_back(Store);
+      } else if (LoadInst *Load = dyn_cast<LoadInst>(Instr)) {
+        Loads.push_back(Load);
+      } else {
+        return false;
+      }
+    }
+    return all_of(Loads, [&](LoadInst *Load) {
+      return any_of(Stores, [&](StoreInst *Store) {
+        return DT.dominates(Store, Load);
+      });
+    });
+  }
+
+  /// Checks if two values computed in the loop are equal and the same in
+  /// every iteration of the loop.
+  bool isSameInvariant(Value *A, Value *B, FusionCandidate *FC,
+                       AAResults &AA) {
+    Instruction *InstrA = dyn_cast<Instruction>(A);
+    if (!InstrA || !FC->getLoop()->contains(InstrA)) {
+      return A == B;
+    }
+    Instruction *InstrB = dyn_cast<Instruction>(B);
+    if (!InstrB || !InstrA->isSameOperationAs(InstrB)) {
+      return false;
+    }
+    if (LoadInst *Load = dyn_cast<LoadInst>(InstrA)) {
+      const DataLayout &DL = Load->getModule()->getDataLayout();
+      if (FC->mayWriteTo(LoopAccess::get(Load->getPointerOperand(),
+                                         Load->getType(), DL),
+                         AA)) {
+        return false;
+      }
+    } else if (!isa<GetElementPtrInst>(InstrA) && !isa<CastInst>(InstrA) &&
+               !isa<BinaryOperator>(InstrA)) {
+      return false;
+    }
+    for (unsigned I = 0; I < InstrA->getNumOperands(); ++I) {
+      if (!isSameInvariant(InstrA->getOperand(I), InstrB->getOperand(I), FC,
+                           AA)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Returns c when the array index is the counter of the loop plus a
+  /// constant c, or std::nullopt otherwise.
+  std::optional<int64_t> getCounterOffset(Value *Index, Loop *L) {
+    int64_t Offset = 0;
+    while (true) {
+      if (isa<SExtInst>(Index) || isa<ZExtInst>(Index)) {
+        Index = cast<Instruction>(Index)->getOperand(0);
+        continue;
+      }
+      BinaryOperator *BinOp = dyn_cast<BinaryOperator>(Index);
+      if (!BinOp) {
+        break;
+      }
+      ConstantInt *ConstInt = dyn_cast<ConstantInt>(BinOp->getOperand(1));
+      if (!ConstInt || !BinOp->hasNoSignedWrap()) {
+        return std::nullopt;
+      }
+      if (BinOp->getOpcode() == Instruction::Add) {
+        Offset += ConstInt->getSExtValue();
+      } else if (BinOp->getOpcode() == Instruction::Sub) {
+        Offset -= ConstInt->getSExtValue();
+      } else {
+        return std::nullopt;
+      }
+      Index = BinOp->getOperand(0);
+    }
+    LoadInst *Load = dyn_cast<LoadInst>(Index);
+    if (!Load || Load->getPointerOperand() != getCounter(L)) {
+      return std::nullopt;
+    }
+    return Offset;
+  }
+
+  /// Checks if access A of loop LA, which is FCA or nested in it, and access
+  /// B of loop LB can only touch the same memory when both counters have the
+  /// same value: both index into the same array, and at one of the
+  /// subscripts both use their counter plus the same constant. At -O0 every
+  /// subscript of `A[i][j]` is a GEP of its own, so chains of GEPs are
+  /// compared subscript by subscript.
+  bool accessSameIteration(Value *A, Loop *LA, FusionCandidate *FCA, Value *B,
+                           Loop *LB, FusionCandidate *FCB, AAResults &AA) {
+    SmallVector<GEPOperator *> ChainA;
+    SmallVector<GEPOperator *> ChainB;
+    while (GEPOperator *GEP = dyn_cast<GEPOperator>(A)) {
+      ChainA.push_back(GEP);
+      A = GEP->getPointerOperand();
+    }
+    while (GEPOperator *GEP = dyn_cast<GEPOperator>(B)) {
+      ChainB.push_back(GEP);
+      B = GEP->getPointerOperand();
+    }
+    if (ChainA.size() != ChainB.size() || !isSameInvariant(A, B, FCA, AA) ||
+        !isSameInvariant(B, A, FCB, AA)) {
+      return false;
+    }
+
+    bool IndexedByCounter = false;
+    for (unsigned I = 0; I < ChainA.size(); ++I) {
+      if (ChainA[I]->getSourceElementType() !=
+              ChainB[I]->getSourceElementType() ||
+          ChainA[I]->getNumIndices() != ChainB[I]->getNumIndices()) {
+        return false;
+      }
+      for (unsigned Index = 1; Index <= ChainA[I]->getNumIndices(); ++Index) {
+        auto OffsetA = getCounterOffset(ChainA[I]->getOperand(Index), LA);
+        auto OffsetB = getCounterOffset(ChainB[I]->getOperand(Index), LB);
+        if (OffsetA && OffsetA == OffsetB) {
+          IndexedByCounter = true;
         }
       }
     }
-    for (Value *V1 : WriteVariables2) {
-      for (Value *V2 : ReadVariables1) {
-        if (V1 == V2) {
-          return true;
+    return IndexedByCounter;
+  }
+
+  /// Collects the loads and stores of the loop, except for accesses to the
+  /// given counters and to variables private to an iteration. Returns false
+  /// if the loop accesses memory in any other way, e.g. by calls.
+  bool collectSharedAccesses(Loop *L, ArrayRef<Value *> Counters,
+                             DominatorTree &DT,
+                             SmallVectorImpl<Instruction *> &Accesses) {
+    for (BasicBlock *BB : L->blocks()) {
+      for (Instruction &Instr : *BB) {
+        if (!Instr.mayReadOrWriteMemory() || isa<DbgInfoIntrinsic>(Instr) ||
+            Instr.isLifetimeStartOrEnd()) {
+          continue;
+        }
+        Value *Pointer = getLoadStorePointerOperand(&Instr);
+        if (!Pointer) {
+          return false;
+        }
+        if (!is_contained(Counters, Pointer) &&
+            !isLoopPrivate(Pointer, L, DT)) {
+          Accesses.push_back(&Instr);
         }
       }
     }
-    return false;
+    return true;
   }
 
-  /// Do all checks to figure out if loops can be fused.
-  bool canFuseLoops(FusionCandidate *L1, FusionCandidate *L2,
-                    ScalarEvolution &SE) {
-    return haveSameTripCounts(L1->getLoop(), L2->getLoop()) &&
-           !areDependent(L1, L2) &&
-           areLoopsAdjacent(L1->getLoop(), L2->getLoop());
+  /// Checks if the iterations of the given loops of the nest can run in a
+  /// different order. Every pair of accesses that may touch the same memory,
+  /// with at least one of them writing to it, has to do so only in the same
+  /// iteration of one of the loops. Dependences DependenceInfo cannot
+  /// disprove are checked on the subscripts, since at -O0 the counters live
+  /// in memory and the subscripts are opaque to SCEV.
+  bool canReorderIterations(FusionCandidate *FC, ArrayRef<Loop *> Loops,
+                            DependenceInfo &DI, DominatorTree &DT,
+                            AAResults &AA) {
+    SmallVector<Value *> Counters;
+    for (Loop *Reordered : Loops) {
+      Counters.push_back(getCounter(Reordered));
+    }
+    const DataLayout &DL = FC->getHeader()->getModule()->getDataLayout();
+    SmallVector<Instruction *> Accesses;
+    if (!collectSharedAccesses(FC->getLoop(), Counters, DT, Accesses)) {
+      return false;
+    }
+
+    for (auto I = Accesses.begin(); I != Accesses.end(); ++I) {
+      for (auto J = I; J != Accesses.end(); ++J) {
+        if (!isa<StoreInst>(*I) && !isa<StoreInst>(*J)) {
+          continue;
+        }
+        Value *PointerI = getLoadStorePointerOperand(*I);
+        Value *PointerJ = getLoadStorePointerOperand(*J);
+        Type *TypeI = getLoadStoreType(*I);
+        Type *TypeJ = getLoadStoreType(*J);
+        if (!LoopAccess::get(PointerI, TypeI, DL)
+                 .mayAlias(LoopAccess::get(PointerJ, TypeJ, DL), AA)) {
+          continue;
+        }
+        std::unique_ptr<Dependence> D = DI.depends(*I, *J, true);
+        if (!D) {
+          continue;
+        }
+        bool SameIteration = any_of(Loops, [&](Loop *Reordered) {
+          unsigned Level = Reordered->getLoopDepth();
+          if (!D->isConfused() && D->getLevels() >= Level &&
+              D->getDirection(Level) == Dependence::DVEntry::EQ) {
+            return true;
+          }
+          return TypeI == TypeJ &&
+                 accessSameIteration(PointerI, Reordered, FC, PointerJ,
+                                     Reordered, FC, AA);
+        });
+        if (!SameIteration) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  /// Checks if the loops only depend on each other in iterations with the
+  /// same counter value, like a consumer `B[i] = A[i] * 2` following the
+  /// producer `A[i] = ...`. Loops with the same trip counts can then be fused
+  /// tile by tile, since a tile of L2 only consumes what the same tile of L1
+  /// produced.
+  bool dependOnlyInSameIteration(FusionCandidate *FC1, FusionCandidate *FC2,
+                                 DominatorTree &DT, AAResults &AA) {
+    Loop *L1 = FC1->getLoop();
+    Loop *L2 = FC2->getLoop();
+    // A counter shared by both loops is reset between them, so tiles of L2
+    // would start over from the first iteration.
+    if (getCounter(L1) == getCounter(L2)) {
+      return false;
+    }
+    SmallVector<Instruction *> Accesses1;
+    SmallVector<Instruction *> Accesses2;
+    if (!collectSharedAccesses(L1, {getCounter(L1)}, DT, Accesses1) ||
+        !collectSharedAccesses(L2, {getCounter(L2)}, DT, Accesses2)) {
+      return false;
+    }
+
+    const DataLayout &DL = FC1->getHeader()->getModule()->getDataLayout();
+    for (Instruction *Access1 : Accesses1) {
+      for (Instruction *Access2 : Accesses2) {
+        if (!isa<StoreInst>(Access1) && !isa<StoreInst>(Access2)) {
+          continue;
+        }
+        Value *Pointer1 = getLoadStorePointerOperand(Access1);
+        Value *Pointer2 = getLoadStorePointerOperand(Access2);
+        Type *Type1 = getLoadStoreType(Access1);
+        Type *Type2 = getLoadStoreType(Access2);
+        if (!LoopAccess::get(Pointer1, Type1, DL)
+                 .mayAlias(LoopAccess::get(Pointer2, Type2, DL), AA)) {
+          continue;
+        }
+        if (Type1 != Type2 || !accessSameIteration(Pointer1, L1, FC1, Pointer2,
+                                                   L2, FC2, AA)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  /// Checks if the code between the loops, the preheader of L2, can be moved
+  /// to the end of the preheader of L1, as fusion does. Code reading what L1
+  /// writes, like `x = A[5]` after a loop writing to A, has to stay after L1.
+  bool canHoistPreheader(FusionCandidate *FC1, FusionCandidate *FC2,
+                         DominatorTree &DT, PostDominatorTree &PDT,
+                         DependenceInfo &DI) {
+    return isSafeToMoveBefore(*FC2->getPreheader(),
+                              *FC1->getPreheader()->getTerminator(), DT, &PDT,
+                              &DI);
+  }
+
+  /// Checks if one of the loops counts down over the same range the other
+  /// one counts up and can be reversed, see reverseLoop. Returns the loop
+  /// that counts down, or nullptr.
+  FusionCandidate *getReversibleLoop(FusionCandidate *FC1,
+                                     FusionCandidate *FC2, AAResults &AA,
+                                     DependenceInfo &DI, DominatorTree &DT) {
+    std::optional<int64_t> Step1 = getConstantStep(FC1->getLoop());
+    std::optional<int64_t> Step2 = getConstantStep(FC2->getLoop());
+    if (!Step1 || !Step2) {
+      return nullptr;
+    }
+    FusionCandidate *Down = nullptr;
+    FusionCandidate *Up = nullptr;
+    if (*Step1 == -1 && *Step2 == 1) {
+      Down = FC1;
+      Up = FC2;
+    } else if (*Step1 == 1 && *Step2 == -1) {
+      Down = FC2;
+      Up = FC1;
+    } else {
+      return nullptr;
+    }
+
+    Loop *DownLoop = Down->getLoop();
+    Loop *UpLoop = Up->getLoop();
+    ICmpInst *DownCmp = getBoundCompare(DownLoop);
+    ICmpInst *UpCmp = getBoundCompare(UpLoop);
+    Value *Counter = getCounter(DownLoop);
+    if (!DownCmp || !UpCmp || !Counter || !getCounter(UpLoop) ||
+        changesCounter(DownLoop) || changesCounter(UpLoop) ||
+        DownCmp->getOperand(0)->getType() != UpCmp->getOperand(0)->getType()) {
+      return nullptr;
+    }
+    for (FusionCandidate *FC : {Down, Up}) {
+      if (FC->getExitingBlock() != FC->getHeader()) {
+        return nullptr;
+      }
+    }
+    // Value the counter has after the loop changes.
+    for (User *U : Counter->users()) {
+      BasicBlock *BB = cast<Instruction>(U)->getParent();
+      if (!DownLoop->contains(BB) && BB != Down->getPreheader()) {
+        return nullptr;
+      }
+    }
+
+    // Down loop runs over [Low, High], the up one over [UpStart, UpEnd].
+    auto Low = getVariableOffset(DownCmp->getOperand(1));
+    auto High = getVariableOffset(getStartValue(DownLoop));
+    auto UpStart = getVariableOffset(getStartValue(UpLoop));
+    auto UpEnd = getVariableOffset(UpCmp->getOperand(1));
+    if (!Low || !High || !UpStart || !UpEnd) {
+      return nullptr;
+    }
+    switch (DownCmp->getPredicate()) {
+    case CmpInst::ICMP_SGE:
+      break;
+    case CmpInst::ICMP_SGT:
+      Low->second += 1;
+      break;
+    default:
+      return nullptr;
+    }
+    switch (UpCmp->getPredicate()) {
+    case CmpInst::ICMP_SLT:
+      UpEnd->second -= 1;
+      break;
+    case CmpInst::ICMP_SLE:
+      break;
+    default:
+      return nullptr;
+    }
+    if (*Low != *UpStart || *High != *UpEnd) {
+      return nullptr;
+    }
+
+    // The reversed loop reads the start value and bound of the other loop.
+    const DataLayout &DL = Down->getHeader()->getModule()->getDataLayout();
+    Type *CounterType = UpCmp->getOperand(0)->getType();
+    for (Value *Variable : {UpStart->first, UpEnd->first}) {
+      if (!Variable) {
+        continue;
+      }
+      LoopAccess Access = LoopAccess::get(Variable, CounterType, DL);
+      if (Down->mayWriteTo(Access, AA) || Up->mayWriteTo(Access, AA)) {
+        return nullptr;
+      }
+    }
+
+    if (!canReorderIterations(Down, {DownLoop}, DI, DT, AA)) {
+      fusionLog() << "Loop counting down has loop-carried dependences.\n";
+      return nullptr;
+    }
+    return Down;
+  }
+
+  /// Checks if the loop only contains a single loop whose control is
+  /// independent of it, with no other code between the two loops than what
+  /// runs them:
+  ///
+  ///   for (i = a; i < b; i += c)
+  ///     for (j = d; j < e; j += f)
+  ///       body
+  ///
+  /// The start values and bounds have to be constants or variables that are
+  /// not written inside of the nest.
+  bool isPerfectNest(FusionCandidate *FC, AAResults &AA) {
+    Loop *Outer = FC->getLoop();
+    if (Outer->getSubLoops().size() != 1) {
+      return false;
+    }
+    Loop *Inner = Outer->getSubLoops().front();
+    if (!Inner->isInnermost() || !Inner->getLoopPreheader() ||
+        !Inner->getExitBlock() ||
+        Inner->getExitingBlock() != Inner->getHeader() ||
+        FC->getExitingBlock() != FC->getHeader()) {
+      return false;
+    }
+    Value *OuterCounter = getCounter(Outer);
+    Value *InnerCounter = getCounter(Inner);
+    if (!OuterCounter || !InnerCounter || OuterCounter == InnerCounter ||
+        changesCounter(Outer) || changesCounter(Inner)) {
+      return false;
+    }
+    // The loops swap their counters, which have to be of the same type, e.g.
+    // not an `int` and a `long`.
+    if (getBoundCompare(Outer)->getOperand(0)->getType() !=
+        getBoundCompare(Inner)->getOperand(0)->getType()) {
+      return false;
+    }
+
+    for (BasicBlock *BB : Outer->blocks()) {
+      if (Inner->contains(BB)) {
+        continue;
+      }
+      if (BB != Outer->getHeader() && BB != Outer->getLoopLatch() &&
+          BB != Inner->getLoopPreheader() && BB != Inner->getExitBlock()) {
+        return false;
+      }
+      for (Instruction &Instr : *BB) {
+        if (isa<CallBase>(Instr) && !isa<DbgInfoIntrinsic>(Instr)) {
+          return false;
+        }
+        StoreInst *Store = dyn_cast<StoreInst>(&Instr);
+        if (Store && Store->getPointerOperand() != OuterCounter &&
+            Store->getPointerOperand() != InnerCounter) {
+          return false;
+        }
+      }
+    }
+    // Both counters end up with different values after an interchange.
+    for (Value *Counter : {OuterCounter, InnerCounter}) {
+      for (User *U : Counter->users()) {
+        BasicBlock *BB = cast<Instruction>(U)->getParent();
+        if (!Outer->contains(BB) && BB != FC->getPreheader()) {
+          return false;
+        }
+      }
+    }
+
+    const DataLayout &DL = FC->getHeader()->getModule()->getDataLayout();
+    for (Loop *L : {Outer, Inner}) {
+      ICmpInst *Cmp = getBoundCompare(L);
+      BinaryOperator *Step = getStepOperation(L);
+      Value *Start = getStartValue(L);
+      if (!Cmp || !Step || !Start || Step->getOpcode() != Instruction::Add ||
+          !isa<ConstantInt>(Step->getOperand(1)) ||
+          !isa<LoadInst>(Step->getOperand(0)) || !Step->hasOneUse() ||
+          !isa<StoreInst>(*Step->user_begin())) {
+        return false;
+      }
+      for (Value *V : {Start, Cmp->getOperand(1)}) {
+        if (isa<ConstantInt>(V)) {
+          continue;
+        }
+        LoadInst *Load = dyn_cast<LoadInst>(V);
+        if (!Load || FC->mayWriteTo(LoopAccess::get(Load->getPointerOperand(),
+                                                    Load->getType(), DL),
+                                    AA)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  /// Estimates how well the innermost loop of a perfect nest uses the cache.
+  /// Every access whose last subscript is the inner counter walks through
+  /// memory with unit stride and adds one, every access whose last subscript
+  /// is the outer counter jumps a whole row per iteration and subtracts one.
+  int getLocalityScore(Loop *Outer) {
+    Loop *Inner = Outer->getSubLoops().front();
+    int Score = 0;
+    for (BasicBlock *BB : Inner->blocks()) {
+      for (Instruction &Instr : *BB) {
+        GEPOperator *GEP =
+            dyn_cast_or_null<GEPOperator>(getLoadStorePointerOperand(&Instr));
+        if (!GEP || GEP->getNumIndices() == 0) {
+          continue;
+        }
+        Value *LastIndex = GEP->getOperand(GEP->getNumIndices());
+        if (getCounterOffset(LastIndex, Inner)) {
+          ++Score;
+        } else if (getCounterOffset(LastIndex, Outer)) {
+          --Score;
+        }
+      }
+    }
+    return Score;
+  }
+
+  /// Checks if both loops are perfect nests whose loops are permutations of
+  /// each other, the outer loop of one running like the inner loop of the
+  /// other. Returns the nest with the worse locality, which is interchanged
+  /// to match the other one, or nullptr if the nests should be left as they
+  /// are.
+  FusionCandidate *getNestToInterchange(FusionCandidate *FC1,
+                                        FusionCandidate *FC2, AAResults &AA,
+                                        DependenceInfo &DI,
+                                        DominatorTree &DT) {
+    if (!isPerfectNest(FC1, AA) || !isPerfectNest(FC2, AA)) {
+      return nullptr;
+    }
+    Loop *Outer1 = FC1->getLoop();
+    Loop *Outer2 = FC2->getLoop();
+    Loop *Inner1 = Outer1->getSubLoops().front();
+    Loop *Inner2 = Outer2->getSubLoops().front();
+    if (!haveSameTripCounts(Outer1, Inner2) ||
+        !haveSameTripCounts(Inner1, Outer2)) {
+      return nullptr;
+    }
+
+    int Score1 = getLocalityScore(Outer1);
+    int Score2 = getLocalityScore(Outer2);
+    FusionCandidate *Worse = Score2 <= Score1 ? FC2 : FC1;
+    // Square nests can be fused as they are, they are only interchanged when
+    // that improves the locality of one of them.
+    bool Aligned = haveSameTripCounts(Outer1, Outer2) &&
+                   haveSameTripCounts(Inner1, Inner2);
+    if (Aligned && std::min(Score1, Score2) >= 0) {
+      return nullptr;
+    }
+
+    Loop *Nest = Worse->getLoop();
+    if (!canReorderIterations(Worse, {Nest, Nest->getSubLoops().front()}, DI,
+                              DT, AA)) {
+      fusionLog() << "Loop nest has dependences that prevent interchange.\n";
+      return nullptr;
+    }
+    return Worse;
+  }
+
+  /// Decides how many iterations each tile of tiled fusion should have.
+  /// Returns 0 when the loops should be fused without tiling, which is the
+  /// case when tiling is disabled or the data accessed by both loops already
+  /// fits into the L1 data cache.
+  unsigned getTileSize(FusionCandidate *L1, FusionCandidate *L2,
+                       const TargetTransformInfo &TTI) {
+    if (!EnableTiledFusion) {
+      return 0;
+    }
+
+    uint64_t BytesPerIteration = L1->getBytesAccessedPerIteration() +
+                                 L2->getBytesAccessedPerIteration();
+    if (BytesPerIteration == 0) {
+      return 0;
+    }
+
+    unsigned CacheSize = DefaultCacheSize;
+    if (auto L1CacheSize =
+            TTI.getCacheSize(TargetTransformInfo::CacheLevel::L1D)) {
+      CacheSize = *L1CacheSize;
+    }
+
+    // A trip count that is not known at compile time is assumed to be large.
+    std::optional<int64_t> TripCount = getConstantTripCount(L1->getLoop());
+    if (TripCount && *TripCount * BytesPerIteration <= CacheSize) {
+      return 0;
+    }
+
+    if (TileSizeOverride) {
+      return TileSizeOverride;
+    }
+    // Power of two tiles keep tile boundaries aligned to cache lines.
+    return std::max<uint64_t>(PowerOf2Floor(CacheSize / BytesPerIteration),
+                              1);
   }
 
   void moveInstructionsToBeginningFromTo(BasicBlock &FromBB, BasicBlock &ToBB) {
@@ -361,11 +1180,507 @@ struct LoopFusion : public FunctionPass {
       LI.changeLoopFor(BB, L1->getLoop());
     }
 
+    // Loops nested in Loop2 are now nested in Loop1
+    while (!L2->getLoop()->isInnermost()) {
+      L1->getLoop()->addChildLoop(
+          L2->getLoop()->removeChildLoop(L2->getLoop()->begin()));
+    }
+
     // Remove the Loop2 from the LLVM IR
     EliminateUnreachableBlocks(F);
     LI.erase(L2->getLoop());
   }
 
+  /// Function that fuses loops at the granularity of tiles. Both loops are
+  /// strip-mined by TileSize iterations and wrapped in a single loop over the
+  /// tiles, so that a tile of L1 is followed by the same tile of L2:
+  ///
+  ///   i = start; j = start;
+  ///   for (t = start; t < bound; t = end) {
+  ///     end = min(t + TileSize, bound);
+  ///     for (; i < end; i += step) L1 body
+  ///     for (; j < end; j += step) L2 body
+  ///   }
+  ///
+  /// The counters are not reset at the start of a tile, so a step that does
+  /// not divide TileSize continues where the previous tile stopped. The data
+  /// a tile of L1 produces is still in cache when L2 consumes it, while both
+  /// inner loops keep their original, simple bodies.
+  Loop *fuseLoopsTiled(FusionCandidate *L1, FusionCandidate *L2,
+                       unsigned TileSize, Function &F, LoopInfo &LI,
+                       DominatorTree &DT, PostDominatorTree &PDT,
+                       DependenceInfo &DI) {
+    LLVMContext &Context = F.getContext();
+    BasicBlock *L1Preheader = L1->getPreheader();
+    BasicBlock *L1Header = L1->getHeader();
+    BasicBlock *L2Preheader = L2->getPreheader();
+    BasicBlock *L2Header = L2->getHeader();
+    BasicBlock *L2ExitBlock = L2->getExitBlock();
+    ICmpInst *L1Cmp = getBoundCompare(L1->getLoop());
+    ICmpInst *L2Cmp = getBoundCompare(L2->getLoop());
+    Value *StartValue = getStartValue(L1->getLoop());
+    Type *CounterType = L1Cmp->getOperand(0)->getType();
+    Value *Bound = L1Cmp->getOperand(1);
+    Value *BoundVariable =
+        isa<ConstantInt>(Bound) ? nullptr : VariablesMap[Bound];
+
+    // Moving instructions from Loop 2 Preheader to Loop 1 Preheader, both
+    // counters are initialized once before the first tile.
+    moveInstructionsToTheEnd(*L2Preheader, *L1Preheader, DT, PDT, DI);
+
+    IRBuilder<> Builder(&*F.getEntryBlock().getFirstInsertionPt());
+    AllocaInst *TileStart =
+        Builder.CreateAlloca(CounterType, nullptr, "tile.start");
+    AllocaInst *TileEnd =
+        Builder.CreateAlloca(CounterType, nullptr, "tile.end");
+
+    BasicBlock *TileCond =
+        BasicBlock::Create(Context, "tile.cond", &F, L1Header);
+    BasicBlock *TileBody =
+        BasicBlock::Create(Context, "tile.body", &F, L1Header);
+    BasicBlock *TileInc =
+        BasicBlock::Create(Context, "tile.inc", &F, L2ExitBlock);
+
+    auto LoadBound = [&](IRBuilder<> &B) -> Value * {
+      if (!BoundVariable) {
+        return Bound;
+      }
+      return B.CreateLoad(CounterType, BoundVariable);
+    };
+
+    // The first tile starts where the loops used to start.
+    Builder.SetInsertPoint(L1Preheader->getTerminator());
+    Builder.CreateStore(StartValue, TileStart);
+    L1Preheader->getTerminator()->replaceUsesOfWith(L1Header, TileCond);
+
+    Builder.SetInsertPoint(TileCond);
+    Value *Start = Builder.CreateLoad(CounterType, TileStart);
+    Builder.CreateCondBr(
+        Builder.CreateICmp(L1Cmp->getPredicate(), Start, LoadBound(Builder)),
+        TileBody, L2ExitBlock);
+
+    // end = bound - start > TileSize ? start + TileSize : bound, written so
+    // that the last tile never overflows the counter.
+    Builder.SetInsertPoint(TileBody);
+    Start = Builder.CreateLoad(CounterType, TileStart);
+    Value *TileBound = LoadBound(Builder);
+    Value *Size = ConstantInt::get(CounterType, TileSize);
+    Value *IsFullTile =
+        Builder.CreateICmpUGT(Builder.CreateSub(TileBound, Start), Size);
+    Builder.CreateStore(Builder.CreateSelect(IsFullTile,
+                                             Builder.CreateAdd(Start, Size),
+                                             TileBound),
+                        TileEnd);
+    Builder.CreateBr(L1Header);
+
+    Builder.SetInsertPoint(TileInc);
+    Builder.CreateStore(Builder.CreateLoad(CounterType, TileEnd), TileStart);
+    Builder.CreateBr(TileCond);
+
+    // Both loops now run until the end of the current tile.
+    for (ICmpInst *Cmp : {L1Cmp, L2Cmp}) {
+      Builder.SetInsertPoint(Cmp);
+      Cmp->setOperand(1, Builder.CreateLoad(CounterType, TileEnd));
+    }
+    L2Header->getTerminator()->replaceUsesOfWith(L2ExitBlock, TileInc);
+
+    // Loop over the tiles becomes the parent of both loops.
+    Loop *TileLoop = LI.AllocateLoop();
+    if (Loop *ParentLoop = L1->getLoop()->getParentLoop()) {
+      ParentLoop->replaceChildLoopWith(L1->getLoop(), TileLoop);
+      ParentLoop->removeChildLoop(L2->getLoop());
+    } else {
+      LI.changeTopLevelLoop(L1->getLoop(), TileLoop);
+      LI.removeLoop(find(LI, L2->getLoop()));
+    }
+    TileLoop->addBasicBlockToLoop(TileCond, LI);
+    TileLoop->addBasicBlockToLoop(TileBody, LI);
+    TileLoop->addBasicBlockToLoop(TileInc, LI);
+    for (BasicBlock *BB : L1->getLoop()->blocks()) {
+      TileLoop->addBlockEntry(BB);
+    }
+    TileLoop->addBlockEntry(L2Preheader);
+    LI.changeLoopFor(L2Preheader, TileLoop);
+    for (BasicBlock *BB : L2->getLoop()->blocks()) {
+      TileLoop->addBlockEntry(BB);
+    }
+    TileLoop->addChildLoop(L1->getLoop());
+    TileLoop->addChildLoop(L2->getLoop());
+
+    // Recalculating Dominator and Post-Dominator Trees
+    DT.recalculate(F);
+    PDT.recalculate(F);
+    return TileLoop;
+  }
+
+  /// Returns the source location of the loop as `file:line:column`, or an
+  /// empty string when the module has no debug info.
+  std::string getLoopLocation(Loop *L) {
+    DebugLoc Loc = L->getStartLoc();
+    if (!Loc) {
+      return "";
+    }
+    return formatv("{0}:{1}:{2}", Loc->getFilename(), Loc.getLine(),
+                   Loc.getCol());
+  }
+
+  /// Describes a loop of a candidate pair. Its trip count is only reported
+  /// when getConstantTripCount knows it, and is null otherwise.
+  json::Object getLoopReport(FusionCandidate *FC) {
+    std::string Location = getLoopLocation(FC->getLoop());
+    std::optional<int64_t> TripCount = getConstantTripCount(FC->getLoop());
+    return json::Object{
+        {"header", FC->getHeader()->getName().str()},
+        {"location", Location.empty() ? json::Value(nullptr)
+                                      : json::Value(std::move(Location))},
+        {"tripCount",
+         TripCount ? json::Value(*TripCount) : json::Value(nullptr)},
+        {"bytesPerIteration", FC->getBytesAccessedPerIteration()},
+    };
+  }
+
+  /// Appends a line with the results of all checks done in the function to
+  /// the report file. Every function is written with a single write, so the
+  /// reports of parallel compiler invocations can share one file.
+  void writeReport(Function &F, size_t NumLoops, json::Array Pairs) {
+    if (ReportFilename.empty() || NumLoops == 0) {
+      return;
+    }
+
+    std::error_code EC;
+    raw_fd_ostream OS(ReportFilename, EC,
+                      sys::fs::OF_Append | sys::fs::OF_Text);
+    if (EC) {
+      errs() << "Could not open fusion report " << ReportFilename << ": "
+             << EC.message() << '\n';
+      return;
+    }
+    json::Object Report{
+        {"module", F.getParent()->getModuleIdentifier()},
+        {"function", F.getName().str()},
+        {"loops", NumLoops},
+        {"candidates", FusionCandidates.size()},
+        {"pairs", std::move(Pairs)},
+    };
+    OS.SetUnbuffered();
+    OS << formatv("{0}\n", json::Value(std::move(Report))).str();
+  }
+
+  /// Copies the blocks of a loop into a new loop placed after the other
+  /// loops of the function. The copy is not inserted into the function, its
+  /// exit branches to ExitBlock.
+  Loop *cloneLoop(Loop *L, BasicBlock *ExitBlock, LoopInfo &LI,
+                  SmallVectorImpl<BasicBlock *> &Blocks) {
+    ValueToValueMapTy VMap;
+    VMap[L->getExitBlock()] = ExitBlock;
+    Loop *Clone = LI.AllocateLoop();
+    for (BasicBlock *BB : L->blocks()) {
+      BasicBlock *NewBB = CloneBasicBlock(BB, VMap, ".split");
+      VMap[BB] = NewBB;
+      Blocks.push_back(NewBB);
+      Clone->addBlockEntry(NewBB);
+      LI.changeLoopFor(NewBB, Clone);
+    }
+    remapInstructionsInBlocks(Blocks, VMap);
+    return Clone;
+  }
+
+  /// Function that fuses loops with different bounds n and m. The fused loop
+  /// runs over the common part of both index sets and is followed by
+  /// remainder loops that finish whichever loop has more iterations left:
+  ///
+  ///   bound = min(n, m)
+  ///   for (i = start; i < bound; i++) { L1 body; L2 body }
+  ///   for (; i < n; i++) L1 body
+  ///   for (; j < m; j++) L2 body
+  ///
+  /// The bound is computed at runtime, so at most one of the remainder loops
+  /// has any iterations. Returns the remainder loops.
+  std::pair<Loop *, Loop *>
+  fuseLoopsSplit(FusionCandidate *L1, FusionCandidate *L2, Function &F,
+                 LoopInfo &LI, DominatorTree &DT, PostDominatorTree &PDT,
+                 DependenceInfo &DI, ScalarEvolution &SE) {
+    LLVMContext &Context = F.getContext();
+    BasicBlock *L2ExitBlock = L2->getExitBlock();
+    ICmpInst *L1Cmp = getBoundCompare(L1->getLoop());
+    ICmpInst *L2Cmp = getBoundCompare(L2->getLoop());
+    Type *CounterType = L1Cmp->getOperand(0)->getType();
+    Value *L1Bound = L1Cmp->getOperand(1);
+    Value *L2Bound = L2Cmp->getOperand(1);
+    Value *L1BoundVariable =
+        isa<ConstantInt>(L1Bound) ? nullptr : VariablesMap[L1Bound];
+    Value *L2BoundVariable =
+        isa<ConstantInt>(L2Bound) ? nullptr : VariablesMap[L2Bound];
+
+    // Remainder loops are created before fusion changes the loops, they stay
+    // outside of the function until the fused loop is in place.
+    BasicBlock *RemainderPreheader1 =
+        BasicBlock::Create(Context, "split.preheader");
+    BasicBlock *RemainderPreheader2 =
+        BasicBlock::Create(Context, "split.preheader");
+    BasicBlock *RemainderExit = BasicBlock::Create(Context, "split.exit");
+    SmallVector<BasicBlock *> Remainder1Blocks;
+    SmallVector<BasicBlock *> Remainder2Blocks;
+    Loop *Remainder1 =
+        cloneLoop(L1->getLoop(), RemainderPreheader2, LI, Remainder1Blocks);
+    Loop *Remainder2 =
+        cloneLoop(L2->getLoop(), RemainderExit, LI, Remainder2Blocks);
+    Loop *ParentLoop = L1->getLoop()->getParentLoop();
+
+    fuseLoops(L1, L2, F, LI, DT, PDT, DI, SE);
+
+    IRBuilder<> Builder(L1->getPreheader()->getTerminator());
+    auto LoadBound = [&](Value *Bound, Value *BoundVariable) -> Value * {
+      if (!BoundVariable) {
+        return Bound;
+      }
+      return Builder.CreateLoad(CounterType, BoundVariable);
+    };
+    Value *Bound1 = LoadBound(L1Bound, L1BoundVariable);
+    Value *Bound2 = LoadBound(L2Bound, L2BoundVariable);
+    Value *CommonBound = Builder.CreateSelect(
+        Builder.CreateICmp(L1Cmp->getPredicate(), Bound1, Bound2), Bound1,
+        Bound2, "split.bound");
+    L1Cmp->setOperand(1, CommonBound);
+    L2Cmp->setOperand(1, CommonBound);
+
+    // Fused loop continues with the remainder loops, which pick up the
+    // counters where the fused loop stopped.
+    for (BasicBlock *BB : L1->getLoop()->blocks()) {
+      BB->getTerminator()->replaceUsesOfWith(L2ExitBlock, RemainderPreheader1);
+    }
+    RemainderPreheader1->insertInto(&F, L2ExitBlock);
+    BranchInst::Create(Remainder1Blocks.front(), RemainderPreheader1);
+    for (BasicBlock *BB : Remainder1Blocks) {
+      BB->insertInto(&F, L2ExitBlock);
+    }
+    RemainderPreheader2->insertInto(&F, L2ExitBlock);
+    BranchInst::Create(Remainder2Blocks.front(), RemainderPreheader2);
+    for (BasicBlock *BB : Remainder2Blocks) {
+      BB->insertInto(&F, L2ExitBlock);
+    }
+    RemainderExit->insertInto(&F, L2ExitBlock);
+    BranchInst::Create(L2ExitBlock, RemainderExit);
+
+    for (Loop *Remainder : {Remainder1, Remainder2}) {
+      if (ParentLoop) {
+        ParentLoop->addChildLoop(Remainder);
+        for (BasicBlock *BB : Remainder->blocks()) {
+          ParentLoop->addBlockEntry(BB);
+        }
+      } else {
+        LI.addTopLevelLoop(Remainder);
+      }
+    }
+    if (ParentLoop) {
+      for (BasicBlock *BB :
+           {RemainderPreheader1, RemainderPreheader2, RemainderExit}) {
+        ParentLoop->addBasicBlockToLoop(BB, LI);
+      }
+    }
+
+    // Recalculating Dominator and Post-Dominator Trees
+    DT.recalculate(F);
+    PDT.recalculate(F);
+    return {Remainder1, Remainder2};
+  }
+
+  /// Returns the key a loop is measured under by -loop-fusion-instrument,
+  /// its source location or `function:header` without debug info.
+  std::string getInstrumentationKey(Loop *L) {
+    std::string Location = getLoopLocation(L);
+    if (Location.empty()) {
+      Location = (L->getHeader()->getParent()->getName() + ":" +
+                  L->getHeader()->getName())
+                     .str();
+    }
+    return Location;
+  }
+
+  /// Region of a single loop of a rejected candidate pair.
+  InstrumentedRegion getRejectedRegion(Loop *L) {
+    return {L, L, {L}, getInstrumentationKey(L), "rejected"};
+  }
+
+  /// Function that measures a region of code at runtime. The cycle counter
+  /// is read right before the region is entered and right after it is left,
+  /// and the iterations are counted in the latches of the counted loops. Both
+  /// are passed to the runtime library, which sums them up per location and
+  /// prints them when the program exits.
+  void instrumentRegion(const InstrumentedRegion &Region, Function &F,
+                        LoopInfo &LI, DominatorTree &DT) {
+    BasicBlock *Preheader = Region.First->getLoopPreheader();
+    // Fused loops leave through the headers of both loops.
+    BasicBlock *ExitBlock = Region.Last->getUniqueExitBlock();
+    bool HaveLatches = all_of(
+        Region.Counted, [](Loop *L) { return L->getLoopLatch() != nullptr; });
+    if (!Preheader || !ExitBlock || !HaveLatches) {
+      fusionLog() << "Loop " << Region.First->getHeader()->getName()
+                  << " cannot be instrumented.\n";
+      return;
+    }
+    LLVMContext &Context = F.getContext();
+    Type *Int64Ty = Type::getInt64Ty(Context);
+
+    // The exit block may also be reached from outside of the region.
+    SmallVector<BasicBlock *> ExitingBlocks;
+    for (BasicBlock *Pred : predecessors(ExitBlock)) {
+      if (Region.Last->contains(Pred)) {
+        ExitingBlocks.push_back(Pred);
+      }
+    }
+    BasicBlock *Exit = SplitBlockPredecessors(ExitBlock, ExitingBlocks,
+                                              ".instrument", &DT, &LI);
+
+    IRBuilder<> Builder(&*F.getEntryBlock().getFirstInsertionPt());
+    AllocaInst *Trips = Builder.CreateAlloca(Int64Ty, nullptr, "loop.trips");
+
+    Builder.SetInsertPoint(Preheader->getTerminator());
+    Builder.CreateStore(ConstantInt::get(Int64Ty, 0), Trips);
+    Value *Start = Builder.CreateIntrinsic(Intrinsic::readcyclecounter, {}, {},
+                                           nullptr, "loop.start");
+
+    for (Loop *Counted : Region.Counted) {
+      Builder.SetInsertPoint(Counted->getLoopLatch()->getTerminator());
+      Builder.CreateStore(
+          Builder.CreateAdd(Builder.CreateLoad(Int64Ty, Trips),
+                            ConstantInt::get(Int64Ty, 1)),
+          Trips);
+    }
+
+    Builder.SetInsertPoint(&*Exit->getFirstInsertionPt());
+    Value *End = Builder.CreateIntrinsic(Intrinsic::readcyclecounter, {}, {},
+                                         nullptr, "loop.end");
+    FunctionCallee Record = F.getParent()->getOrInsertFunction(
+        "__loop_fusion_record", Type::getVoidTy(Context),
+        Builder.getInt8PtrTy(), Builder.getInt8PtrTy(), Int64Ty, Int64Ty);
+    Builder.CreateCall(Record,
+                       {Builder.CreateGlobalStringPtr(Region.Location),
+                        Builder.CreateGlobalStringPtr(Region.Status),
+                                Builder.CreateSub(End, Start),
+                                Builder.CreateLoad(Int64Ty, Trips)});
+  }
+
+  /// Returns a value that can be used in place of V before InsertBefore,
+  /// which may be in another block. At -O0 a variable V was loaded from is
+  /// loaded again there, constants are returned as they are.
+  Value *copyValue(Value *V, Instruction *InsertBefore) {
+    LoadInst *Load = dyn_cast<LoadInst>(V);
+    if (!Load) {
+      return V;
+    }
+    LoadInst *Copy = new LoadInst(Load->getType(), Load->getPointerOperand(),
+                                  "", InsertBefore);
+    VariablesMap[Copy] = Load->getPointerOperand();
+    return Copy;
+  }
+
+  /// Function that makes a loop counting down run over the same values in
+  /// the opposite direction, with the same start value, bound and step as the
+  /// loop counting up:
+  ///
+  ///   for (i = n - 1; i >= 0; i--)  becomes  for (i = 0; i < n; i++)
+  ///
+  /// The body is left unchanged, it still sees every value of the counter
+  /// exactly once.
+  void reverseLoop(FusionCandidate *Down, FusionCandidate *Up) {
+    Loop *UpLoop = Up->getLoop();
+    ICmpInst *DownCmp = getBoundCompare(Down->getLoop());
+    ICmpInst *UpCmp = getBoundCompare(UpLoop);
+    BinaryOperator *DownStep = getStepOperation(Down->getLoop());
+    BinaryOperator *UpStep = getStepOperation(UpLoop);
+
+    // Last store of the preheader initializes the counter.
+    StoreInst *StartStore = nullptr;
+    for (Instruction &Instr : *Down->getPreheader()) {
+      if (StoreInst *Store = dyn_cast<StoreInst>(&Instr)) {
+        StartStore = Store;
+      }
+    }
+    Value *OldStart = StartStore->getValueOperand();
+    StartStore->setOperand(0, copyValue(getStartValue(UpLoop), StartStore));
+    RecursivelyDeleteTriviallyDeadInstructions(OldStart);
+
+    Value *OldBound = DownCmp->getOperand(1);
+    DownCmp->setPredicate(UpCmp->getPredicate());
+    DownCmp->setOperand(1, copyValue(UpCmp->getOperand(1), DownCmp));
+    RecursivelyDeleteTriviallyDeadInstructions(OldBound);
+
+    BinaryOperator *NewStep = BinaryOperator::Create(
+        UpStep->getOpcode(), DownStep->getOperand(0), UpStep->getOperand(1),
+        "", DownStep);
+    NewStep->copyIRFlags(UpStep);
+    NewStep->takeName(DownStep);
+    DownStep->replaceAllUsesWith(NewStep);
+    DownStep->eraseFromParent();
+  }
+
+  /// Function that interchanges the loops of a perfect nest. The loops swap
+  /// their counters, start values, bounds and steps, so the outer loop runs
+  /// over what the inner loop used to and vice versa:
+  ///
+  ///   for (i = 0; i < n; i++)          for (j = 0; j < m; j++)
+  ///     for (j = 0; j < m; j++)   ->     for (i = 0; i < n; i++)
+  ///       body                             body
+  ///
+  /// The body is left unchanged, it still reads both counters from memory.
+  void interchangeLoops(FusionCandidate *FC) {
+    struct LoopControl {
+      Value *Counter;
+      StoreInst *StartStore;
+      Value *Start;
+      ICmpInst *Cmp;
+      CmpInst::Predicate Predicate;
+      Value *Bound;
+      BinaryOperator *Step;
+      Value *StepValue;
+      StoreInst *StepStore;
+    };
+
+    auto GetControl = [&](Loop *L) -> LoopControl {
+      LoopControl Control{};
+      Control.Counter = getCounter(L);
+      for (Instruction &Instr : *L->getLoopPreheader()) {
+        if (StoreInst *Store = dyn_cast<StoreInst>(&Instr)) {
+          Control.StartStore = Store;
+        }
+      }
+      Control.Start = Control.StartStore->getValueOperand();
+      Control.Cmp = getBoundCompare(L);
+      Control.Predicate = Control.Cmp->getPredicate();
+      Control.Bound = Control.Cmp->getOperand(1);
+      Control.Step = getStepOperation(L);
+      Control.StepValue = Control.Step->getOperand(1);
+      Control.StepStore = cast<StoreInst>(*Control.Step->user_begin());
+      return Control;
+    };
+
+    Loop *Outer = FC->getLoop();
+    Loop *Inner = Outer->getSubLoops().front();
+    LoopControl OuterControl = GetControl(Outer);
+    LoopControl InnerControl = GetControl(Inner);
+
+    // Both controls are read before either loop is changed, since the start
+    // store of the outer loop is rewritten before it is copied to the inner
+    // one.
+    auto SetControl = [&](LoopControl &To, const LoopControl &From) {
+      To.StartStore->setOperand(0, copyValue(From.Start, To.StartStore));
+      To.StartStore->setOperand(1, From.Counter);
+      cast<LoadInst>(To.Cmp->getOperand(0))->setOperand(0, From.Counter);
+      To.Cmp->setPredicate(From.Predicate);
+      To.Cmp->setOperand(1, copyValue(From.Bound, To.Cmp));
+      cast<LoadInst>(To.Step->getOperand(0))->setOperand(0, From.Counter);
+      To.Step->setOperand(1, From.StepValue);
+      To.StepStore->setOperand(1, From.Counter);
+    };
+    SetControl(OuterControl, InnerControl);
+    SetControl(InnerControl, OuterControl);
+    for (Value *Old : {OuterControl.Start, InnerControl.Start,
+                       OuterControl.Bound, InnerControl.Bound}) {
+      RecursivelyDeleteTriviallyDeadInstructions(Old);
+    }
+  }
+
   void getAnalysisUsage(AnalysisUsage &AU) const override {
     AU.addRequiredID(LoopSimplifyID);
     AU.addRequired<LoopInfoWrapperPass>();
@@ -373,6 +1688,8 @@ struct LoopFusion : public FunctionPass {
     AU.addRequired<DependenceAnalysisWrapperPass>();
     AU.addRequired<ScalarEvolutionWrapperPass>();
     AU.addRequired<PostDominatorTreeWrapperPass>();
+    AU.addRequired<TargetTransformInfoWrapperPass>();
+    AU.addRequired<AAResultsWrapperPass>();
 
     AU.setPreservesAll();
   }
@@ -391,7 +1708,13 @@ struct LoopFusion : public FunctionPass {
     auto &DI = getAnalysis<DependenceAnalysisWrapperPass>().getDI();
     auto &SE = getAnalysis<ScalarEvolutionWrapperPass>().getSE();
     auto &PDT = getAnalysis<PostDominatorTreeWrapperPass>().getPostDomTree();
+    auto &TTI = getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+    auto &AA = getAnalysis<AAResultsWrapperPass>().getAAResults();
 
+    // The pass object is reused for every function of the module.
+    FusionCandidates.clear();
+    VariablesMap.clear();
+    InstrumentedRegions.clear();
     mapVariables(&F);
 
     // Collect fusion candidates.
@@ -404,34 +1727,144 @@ struct LoopFusion : public FunctionPass {
     }
 
     if (FusionCandidates.size() < 2) {
-      dbgs() << "Not enough candidates for fusion.\n";
+      fusionLog() << "Not enough candidates for fusion.\n";
+      writeReport(F, FunctionLoops.size(), json::Array());
       return true;
     }
 
+    json::Array Pairs;
     std::reverse(std::begin(FusionCandidates), std::end(FusionCandidates));
     for (int I = 0; I < FusionCandidates.size() - 1; ++I) {
-      dbgs() << "HAVE SAME TRIP COUNTS: "
-             << haveSameTripCounts(FusionCandidates[I].getLoop(),
-                                   FusionCandidates[I + 1].getLoop())
-             << '\n';
+      FusionCandidate *FC1 = &FusionCandidates[I];
+      FusionCandidate *FC2 = &FusionCandidates[I + 1];
 
-      dbgs() << "ARE ADJECENT: "
-             << areLoopsAdjacent(FusionCandidates[I].getLoop(),
-                                 FusionCandidates[I + 1].getLoop())
-             << '\n';
+      bool SameTripCounts = haveSameTripCounts(FC1->getLoop(), FC2->getLoop());
+      bool Adjacent = areLoopsAdjacent(FC1->getLoop(), FC2->getLoop());
+      bool Dependent = areDependent(FC1, FC2, AA);
 
-      dbgs() << "ARE NOT DEPENDANT: "
-             << !areDependent(&FusionCandidates[I], &FusionCandidates[I + 1])
-             << '\n';
-      dbgs() << "CAN FUSE: "
-             << canFuseLoops(&FusionCandidates[I], &FusionCandidates[I + 1], SE)
-             << '\n';
-      if (canFuseLoops(&FusionCandidates[I], &FusionCandidates[I + 1], SE)) {
-        fuseLoops(&FusionCandidates[I], &FusionCandidates[I + 1], F, LI, DT,
-                  PDT, DI, SE);
+      // A loop counting down over the same range is reversed first.
+      bool Reversed = false;
+      if (!SameTripCounts && !Dependent && Adjacent) {
+        if (FusionCandidate *Down = getReversibleLoop(FC1, FC2, AA, DI, DT)) {
+          fusionLog() << "REVERSING LOOP: " << Down->getHeader()->getName()
+                      << '\n';
+          if (!DryRun) {
+            reverseLoop(Down, Down == FC1 ? FC2 : FC1);
+          }
+          SameTripCounts =
+              DryRun || haveSameTripCounts(FC1->getLoop(), FC2->getLoop());
+          Reversed = true;
+        }
       }
+
+      // Nests that run over the same space in a different loop order are
+      // interchanged to match each other.
+      bool Interchanged = false;
+      if (!Reversed && !Dependent && Adjacent) {
+        if (FusionCandidate *Nest =
+                getNestToInterchange(FC1, FC2, AA, DI, DT)) {
+          fusionLog() << "INTERCHANGING LOOP NEST: "
+                      << Nest->getHeader()->getName() << '\n';
+          if (!DryRun) {
+            interchangeLoops(Nest);
+          }
+          SameTripCounts =
+              DryRun || haveSameTripCounts(FC1->getLoop(), FC2->getLoop());
+          Interchanged = true;
+        }
+      }
+      bool CanSplit = !SameTripCounts && !Dependent && Adjacent &&
+                      canSplitIndexSet(FC1, FC2, AA);
+      // A tile of the second loop runs after the same tile of the first one,
+      // so it may consume what that tile produced.
+      unsigned TileSize = 0;
+      if (SameTripCounts && !CanSplit && Adjacent &&
+          haveCanonicalShape(FC1, FC2, AA) &&
+          canHoistPreheader(FC1, FC2, DT, PDT, DI) &&
+          (!Dependent || dependOnlyInSameIteration(FC1, FC2, DT, AA))) {
+        TileSize = getTileSize(FC1, FC2, TTI);
+      }
+      bool CanFuse =
+          ((SameTripCounts || CanSplit) && !Dependent && Adjacent) || TileSize;
+
+      fusionLog() << "HAVE SAME TRIP COUNTS: " << SameTripCounts << '\n';
+      fusionLog() << "ARE ADJECENT: " << Adjacent << '\n';
+      fusionLog() << "ARE NOT DEPENDANT: " << !Dependent << '\n';
+      fusionLog() << "CAN SPLIT INDEX SET: " << CanSplit << '\n';
+      fusionLog() << "CAN FUSE: " << CanFuse << '\n';
+
+      if (!ReportFilename.empty()) {
+        json::Array Failed;
+        if (!SameTripCounts) {
+          Failed.push_back("haveSameTripCounts");
+        }
+        if (Dependent && !TileSize) {
+          Failed.push_back("areDependent");
+        }
+        if (!Adjacent) {
+          Failed.push_back("areLoopsAdjacent");
+        }
+        Pairs.push_back(json::Object{
+            {"loops", json::Array{getLoopReport(FC1), getLoopReport(FC2)}},
+            {"failed", std::move(Failed)},
+            {"verdict", !CanFuse    ? "reject"
+                        : CanSplit ? "fuse-split"
+                        : TileSize ? "fuse-tiled"
+                                   : "fuse"},
+            {"tileSize", TileSize},
+            {"reversed", Reversed},
+            {"interchanged", Interchanged},
+        });
+      }
+
+      if (!CanFuse) {
+        InstrumentedRegions.insert(
+            {FC1->getLoop(), getRejectedRegion(FC1->getLoop())});
+        InstrumentedRegions.insert(
+            {FC2->getLoop(), getRejectedRegion(FC2->getLoop())});
+        continue;
+      }
+      // The pair is measured as a whole under the locations of both loops,
+      // whether it was fused or not. The first loop may have been rejected
+      // together with the loop before it.
+      Loop *L1 = FC1->getLoop();
+      std::string PairKey = getInstrumentationKey(L1) + "+" +
+                            getInstrumentationKey(FC2->getLoop());
+      if (DryRun) {
+        // Loops are measured as they are, as a baseline for the fused build,
+        // which also skips the pair the second loop forms with the next one.
+        InstrumentedRegions[L1] = {L1, FC2->getLoop(), {L1}, PairKey,
+                                   "unfused"};
+        ++I;
+        continue;
+      }
+      if (CanSplit) {
+        auto [Remainder1, Remainder2] =
+            fuseLoopsSplit(FC1, FC2, F, LI, DT, PDT, DI, SE);
+        InstrumentedRegions[L1] = {L1, Remainder2, {L1, Remainder1}, PairKey,
+                                   "fused"};
+      } else if (TileSize) {
+        fusionLog() << "TILE SIZE: " << TileSize << '\n';
+        Loop *TileLoop =
+            fuseLoopsTiled(FC1, FC2, TileSize, F, LI, DT, PDT, DI);
+        InstrumentedRegions[L1] = {TileLoop, TileLoop, {L1}, PairKey, "fused"};
+      } else {
+        fuseLoops(FC1, FC2, F, LI, DT, PDT, DI, SE);
+        InstrumentedRegions[L1] = {L1, L1, {L1}, PairKey, "fused"};
+      }
+      // The second loop is now a part of the first one, skip the pair it
+      // would form with the next candidate.
+      ++I;
     }
 
+    writeReport(F, FunctionLoops.size(), std::move(Pairs));
+
+    if (InstrumentLoops) {
+      for (auto &[L, Region] : InstrumentedRegions) {
+        instrumentRegion(Region, F, LI, DT);
+      }
+      PDT.recalculate(F);
+    }
     return true;
   }
 };
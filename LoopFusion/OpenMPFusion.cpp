@@ -0,0 +1,270 @@
+#include "FusionCandidate.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/raw_ostream.h"
+
+#define DEBUG_TYPE "loop-fusion"
+
+using namespace llvm;
+
+// Schedule type the OpenMP runtime uses for `schedule(static)` without a chunk
+// size, which is also the default schedule of a worksharing loop.
+static constexpr int64_t StaticSchedule = 34;
+
+namespace {
+
+/// Memory of the enclosing function that an outlined parallel region reads or
+/// writes. Object is the enclosing function itself when the memory could not
+/// be determined.
+struct SharedAccess {
+  const Value *Object;
+  bool IsWrite;
+};
+
+/// Parallel region created by `#pragma omp parallel for`. The frontend outlines
+/// the region into a microtask that is started by
+/// `__kmpc_fork_call(Loc, NumArgs, Microtask, Args...)`, where Args are the
+/// addresses of the variables the region captures.
+struct ParallelRegion {
+  CallInst *ForkCall;
+  Function *Microtask;
+  std::vector<SharedAccess> Accesses;
+};
+
+struct OpenMPFusion : public ModulePass {
+  static char ID; // Pass identification, replacement for typeid
+
+  OpenMPFusion() : ModulePass(ID) {}
+
+  /// Checks if the microtask only consists of a single worksharing loop with a
+  /// static schedule, with no other synchronization or calls inside of it.
+  bool isStaticWorksharingLoop(Function *Microtask) {
+    if (Microtask->isDeclaration() || Microtask->arg_size() < 2) {
+      return false;
+    }
+
+    unsigned StaticInitCalls = 0;
+    for (Instruction &Instr : instructions(Microtask)) {
+      CallBase *Call = dyn_cast<CallBase>(&Instr);
+      if (!Call || isa<DbgInfoIntrinsic>(Call) ||
+          Call->isLifetimeStartOrEnd()) {
+        continue;
+      }
+      Function *Callee = Call->getCalledFunction();
+      if (!Callee) {
+        return false;
+      }
+      if (Callee->getName().startswith("__kmpc_for_static_init_")) {
+        ConstantInt *Schedule = dyn_cast<ConstantInt>(Call->getArgOperand(2));
+        if (!Schedule || Schedule->getSExtValue() != StaticSchedule) {
+          return false;
+        }
+        ++StaticInitCalls;
+        continue;
+      }
+      if (Callee->getName() != "__kmpc_for_static_fini") {
+        return false;
+      }
+    }
+    return StaticInitCalls == 1;
+  }
+
+  /// Maps the object a pointer of the microtask points into to the object of
+  /// the enclosing function. Returns nullptr when the memory is private to the
+  /// microtask and the enclosing function itself when it is not known.
+  const Value *getSharedObject(const ParallelRegion &Region,
+                               const Value *Pointer) {
+    const Value *Object = getAccessedObject(Pointer);
+    if (isa<AllocaInst>(Object)) {
+      return nullptr;
+    }
+    if (isa<GlobalVariable>(Object)) {
+      return Object;
+    }
+
+    // Loads of a captured pointer variable point into whatever the variable
+    // of the enclosing function was initialized with.
+    bool IsPointee = false;
+    if (const LoadInst *Load = dyn_cast<LoadInst>(Object)) {
+      Object = getAccessedObject(Load->getPointerOperand());
+      IsPointee = true;
+    }
+
+    const Argument *Arg = dyn_cast<Argument>(Object);
+    if (!Arg || Arg->getParent() != Region.Microtask) {
+      return Region.ForkCall->getFunction();
+    }
+    // Global and bound thread ids are provided by the runtime.
+    if (Arg->getArgNo() < 2) {
+      return IsPointee ? Region.ForkCall->getFunction() : nullptr;
+    }
+
+    const Value *Captured = getAccessedObject(
+        Region.ForkCall->getArgOperand(Arg->getArgNo() - 2 + 3));
+    if (!IsPointee) {
+      return Captured;
+    }
+    const AllocaInst *Variable = dyn_cast<AllocaInst>(Captured);
+    const Value *Initializer =
+        Variable ? getVariableInitializer(Variable) : nullptr;
+    if (!Initializer) {
+      return Region.ForkCall->getFunction();
+    }
+    return getAccessedObject(Initializer);
+  }
+
+  void collectSharedAccesses(ParallelRegion &Region) {
+    for (Instruction &Instr : instructions(Region.Microtask)) {
+      Value *Pointer = getLoadStorePointerOperand(&Instr);
+      if (!Pointer) {
+        continue;
+      }
+      if (const Value *Object = getSharedObject(Region, Pointer)) {
+        Region.Accesses.push_back({Object, isa<StoreInst>(&Instr)});
+      }
+    }
+  }
+
+  /// Checks if two regions may touch the same memory with at least one of
+  /// them writing to it. Memory that is not known to belong to a distinct
+  /// allocation is assumed to be shared.
+  bool areDependent(const ParallelRegion &R1, const ParallelRegion &R2) {
+    Function *Caller = R1.ForkCall->getFunction();
+    for (const SharedAccess &A1 : R1.Accesses) {
+      for (const SharedAccess &A2 : R2.Accesses) {
+        if (!A1.IsWrite && !A2.IsWrite) {
+          continue;
+        }
+        if (A1.Object == Caller || A2.Object == Caller ||
+            A1.Object == A2.Object || !isIdentifiedObject(A1.Object) ||
+            !isIdentifiedObject(A2.Object)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  /// Replaces adjacent parallel regions with a single one whose microtask
+  /// calls the original microtasks one after another. A barrier is placed
+  /// between two loops only if the later one depends on a loop executed
+  /// since the previous barrier, otherwise threads continue with their share
+  /// of the next loop right away.
+  void fuseRegions(std::vector<ParallelRegion> &Regions, Module &M) {
+    LLVMContext &Context = M.getContext();
+    CallInst *FirstFork = Regions.front().ForkCall;
+    Function *FirstMicrotask = Regions.front().Microtask;
+
+    SmallVector<Type *> ParamTypes{FirstMicrotask->getArg(0)->getType(),
+                                   FirstMicrotask->getArg(1)->getType()};
+    SmallVector<Value *> ForkArgs{FirstFork->getArgOperand(0), nullptr,
+                                  nullptr};
+    for (ParallelRegion &Region : Regions) {
+      for (Argument &Arg : drop_begin(Region.Microtask->args(), 2)) {
+        ParamTypes.push_back(Arg.getType());
+        ForkArgs.push_back(
+            Region.ForkCall->getArgOperand(Arg.getArgNo() - 2 + 3));
+      }
+    }
+
+    Function *Fused = Function::Create(
+        FunctionType::get(Type::getVoidTy(Context), ParamTypes, false),
+        GlobalValue::InternalLinkage, FirstMicrotask->getName() + ".fused", M);
+    IRBuilder<> Builder(BasicBlock::Create(Context, "entry", Fused));
+    std::vector<const ParallelRegion *> SinceBarrier;
+    unsigned ArgNo = 2;
+    for (ParallelRegion &Region : Regions) {
+      bool NeedsBarrier = any_of(SinceBarrier, [&](const ParallelRegion *R) {
+        return areDependent(*R, Region);
+      });
+      if (NeedsBarrier) {
+        FunctionCallee Barrier = M.getOrInsertFunction(
+            "__kmpc_barrier", Type::getVoidTy(Context),
+            FirstFork->getArgOperand(0)->getType(), Type::getInt32Ty(Context));
+        Value *ThreadId =
+            Builder.CreateLoad(Type::getInt32Ty(Context), Fused->getArg(0));
+        Builder.CreateCall(Barrier, {FirstFork->getArgOperand(0), ThreadId});
+        SinceBarrier.clear();
+      }
+      fusionLog() << "FUSING OPENMP REGION " << Region.Microtask->getName()
+                  << (NeedsBarrier ? " AFTER BARRIER" : "") << '\n';
+
+      SmallVector<Value *> CallArgs{Fused->getArg(0), Fused->getArg(1)};
+      for (unsigned I = 2; I < Region.Microtask->arg_size(); ++I) {
+        CallArgs.push_back(Fused->getArg(ArgNo++));
+      }
+      Builder.CreateCall(Region.Microtask, CallArgs);
+      SinceBarrier.push_back(&Region);
+    }
+    Builder.CreateRetVoid();
+
+    ForkArgs[1] = ConstantInt::get(FirstFork->getArgOperand(1)->getType(),
+                                   ForkArgs.size() - 3);
+    ForkArgs[2] = ConstantExpr::getPointerCast(
+        Fused, FirstFork->getArgOperand(2)->getType());
+    CallInst *FusedFork = CallInst::Create(FirstFork->getFunctionType(),
+                                           FirstFork->getCalledOperand(),
+                                           ForkArgs, "", FirstFork);
+    FusedFork->setDebugLoc(FirstFork->getDebugLoc());
+    for (ParallelRegion &Region : Regions) {
+      Region.ForkCall->eraseFromParent();
+    }
+  }
+
+  bool runOnModule(Module &M) override {
+    Function *ForkCall = M.getFunction("__kmpc_fork_call");
+    if (!ForkCall) {
+      return false;
+    }
+
+    // Collect runs of parallel regions that directly follow each other.
+    std::vector<std::vector<ParallelRegion>> Runs;
+    for (Function &F : M) {
+      std::vector<ParallelRegion> Run;
+      for (Instruction &Instr : instructions(F)) {
+        CallInst *Call = dyn_cast<CallInst>(&Instr);
+        if (!Call || Call->getCalledFunction() != ForkCall) {
+          continue;
+        }
+        Function *Microtask =
+            dyn_cast<Function>(Call->getArgOperand(2)->stripPointerCasts());
+        if (!Microtask || !isStaticWorksharingLoop(Microtask)) {
+          fusionLog() << "Parallel region is not a static worksharing loop.\n";
+          continue;
+        }
+
+        if (!Run.empty() &&
+            Run.back().ForkCall->getNextNonDebugInstruction() != Call) {
+          Runs.push_back(std::move(Run));
+          Run.clear();
+        }
+        ParallelRegion Region{Call, Microtask, {}};
+        collectSharedAccesses(Region);
+        Run.push_back(std::move(Region));
+      }
+      Runs.push_back(std::move(Run));
+    }
+
+    bool Changed = false;
+    for (std::vector<ParallelRegion> &Run : Runs) {
+      if (Run.size() < 2) {
+        continue;
+      }
+      fuseRegions(Run, M);
+      Changed = true;
+    }
+    return Changed;
+  }
+};
+} // namespace
+
+char OpenMPFusion::ID = 0;
+static RegisterPass<OpenMPFusion>
+    X("loopfusion-omp", "Loop Fusion Pass for OpenMP worksharing loops");
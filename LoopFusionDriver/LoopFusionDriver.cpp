@@ -0,0 +1,261 @@
+// Standalone driver that runs loop fusion over a whole module in parallel.
+//
+// LLVMContext is not thread safe, so the module is split into partitions that
+// are serialized to bitcode and fused on a thread pool, each in its own
+// context with its own pass manager. The fused partitions are then linked back
+// into a single module.
+#include "FusionCandidate.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Pass.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+#include <chrono>
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFilename(cl::Positional, cl::Required,
+                                          cl::desc("<input module>"));
+
+static cl::opt<std::string> OutputFilename("o", cl::init("-"),
+                                           cl::value_desc("filename"),
+                                           cl::desc("Output bitcode file"));
+
+static cl::opt<bool> OutputAssembly("S",
+                                    cl::desc("Write output as LLVM assembly"));
+
+static cl::opt<unsigned>
+    Threads("j", cl::init(0),
+            cl::desc("Number of threads (0 uses all available cores)"));
+
+static cl::opt<unsigned> Partitions(
+    "partitions", cl::init(0),
+    cl::desc("Number of partitions the module is split into (0 uses four "
+             "per thread, so that large functions do not stall a thread)"));
+
+static cl::opt<bool> FuseOpenMP("omp",
+                                cl::desc("Also fuse OpenMP worksharing loops"));
+
+static cl::opt<bool> ReportScaling(
+    "report-scaling",
+    cl::desc("Fuse the module with 1, 2, 4, ... threads up to -j and report "
+             "the wall-clock time of each run"));
+
+static cl::opt<bool> PrintChecks(
+    "print-checks",
+    cl::desc("Print the checks done for every candidate pair, partition by "
+             "partition once all of them are fused"));
+
+static ExitOnError ExitOnErr("loop-fusion-driver: ");
+
+/// Creates the TargetTransformInfo of the module's target, so that the cost
+/// model sees the same cache parameters as under `opt`.
+static auto createTargetMachine(const Module &M)
+    -> std::unique_ptr<TargetMachine> {
+  std::string Error;
+  const Target *TheTarget =
+      TargetRegistry::lookupTarget(M.getTargetTriple(), Error);
+  if (!TheTarget) {
+    return nullptr;
+  }
+  return std::unique_ptr<TargetMachine>(TheTarget->createTargetMachine(
+      M.getTargetTriple(), "", "", TargetOptions(), {}));
+}
+
+/// The passes are registered by their RegisterPass objects, just like when
+/// the plugin is loaded into `opt`.
+static auto createRegisteredPass(StringRef Name) -> Pass * {
+  return PassRegistry::getPassRegistry()->getPassInfo(Name)->createPass();
+}
+
+/// Fuses loops of a single partition in a context of its own. The partition
+/// keeps the identifier of the whole module, which the fusion report refers
+/// to. What the passes print is collected in Log instead of being written to
+/// stderr by all threads at once, if PrintLog is set.
+static auto fusePartition(StringRef Bitcode, StringRef ModuleIdentifier,
+                          bool PrintLog, std::string &Log) -> SmallString<0> {
+  LLVMContext Context;
+  std::unique_ptr<Module> Partition = ExitOnErr(
+      parseBitcodeFile(MemoryBufferRef(Bitcode, ModuleIdentifier), Context));
+
+  raw_string_ostream LogStream(Log);
+  raw_null_ostream NullStream;
+  if (PrintLog) {
+    setFusionLog(&LogStream);
+  } else {
+    setFusionLog(&NullStream);
+  }
+
+  std::unique_ptr<TargetMachine> TM = createTargetMachine(*Partition);
+  legacy::PassManager PM;
+  if (TM) {
+    PM.add(createTargetTransformInfoWrapperPass(TM->getTargetIRAnalysis()));
+  }
+  if (FuseOpenMP) {
+    PM.add(createRegisteredPass("loopfusion-omp"));
+  }
+  PM.add(createRegisteredPass("loopfusion"));
+  PM.run(*Partition);
+  setFusionLog(nullptr);
+
+  SmallString<0> Result;
+  raw_svector_ostream OS(Result);
+  WriteBitcodeToFile(*Partition, OS);
+  return Result;
+}
+
+/// Splits the module, fuses the partitions on NumThreads threads and links
+/// them back together. The checks are printed only if PrintLog is set.
+static auto fuseModule(std::unique_ptr<Module> M, unsigned NumThreads,
+                       unsigned NumPartitions, bool PrintLog)
+    -> std::unique_ptr<Module> {
+  std::string ModuleIdentifier = M->getModuleIdentifier();
+  std::vector<SmallString<0>> Inputs;
+  SplitModule(
+      *M, NumPartitions,
+      [&](std::unique_ptr<Module> Partition) {
+        raw_svector_ostream OS(Inputs.emplace_back());
+        WriteBitcodeToFile(*Partition, OS);
+      },
+      /*PreserveLocals=*/true);
+
+  std::vector<SmallString<0>> Outputs(Inputs.size());
+  std::vector<std::string> Logs(Inputs.size());
+  ThreadPool Pool(hardware_concurrency(NumThreads));
+  for (size_t I = 0; I < Inputs.size(); ++I) {
+    Pool.async([&, I] {
+      Outputs[I] =
+          fusePartition(Inputs[I], ModuleIdentifier, PrintLog, Logs[I]);
+    });
+  }
+  Pool.wait();
+  for (const std::string &Log : Logs) {
+    errs() << Log;
+  }
+
+  LLVMContext &Context = M->getContext();
+  std::unique_ptr<Module> Result = ExitOnErr(parseBitcodeFile(
+      MemoryBufferRef(Outputs.front(), ModuleIdentifier), Context));
+  Linker L(*Result);
+  for (SmallString<0> &Output : drop_begin(Outputs)) {
+    std::unique_ptr<Module> Partition = ExitOnErr(parseBitcodeFile(
+        MemoryBufferRef(Output, ModuleIdentifier), Context));
+    if (L.linkInModule(std::move(Partition))) {
+      ExitOnErr(createStringError(inconvertibleErrorCode(),
+                                  "failed to link fused partitions"));
+    }
+  }
+  return Result;
+}
+
+static auto loadModule(LLVMContext &Context) -> std::unique_ptr<Module> {
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIRFile(InputFilename, Err, Context);
+  if (!M) {
+    Err.print("loop-fusion-driver", errs());
+    exit(1);
+  }
+  return M;
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  InitializeNativeTarget();
+
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeAnalysis(Registry);
+  initializeTransformUtils(Registry);
+  initializeScalarOpts(Registry);
+
+  cl::ParseCommandLineOptions(argc, argv,
+                              "Parallel loop fusion over a whole module\n");
+
+  unsigned MaxThreads =
+      Threads ? Threads : hardware_concurrency().compute_thread_count();
+  unsigned NumPartitions = Partitions ? Partitions : 4 * MaxThreads;
+
+  // Every run starts from a freshly loaded module, so that runs with a
+  // different number of threads do the same amount of work.
+  std::vector<unsigned> ThreadCounts;
+  if (ReportScaling) {
+    for (unsigned Count = 1; Count < MaxThreads; Count *= 2) {
+      ThreadCounts.push_back(Count);
+    }
+  }
+  ThreadCounts.push_back(MaxThreads);
+
+  // The same module is fused by every run, so only the last one prints the
+  // checks and writes the fusion report, which would be repeated otherwise.
+  auto *Report = static_cast<cl::opt<std::string> *>(
+      cl::getRegisteredOptions().lookup("loop-fusion-report"));
+  std::string ReportFile = Report ? Report->getValue() : "";
+
+  LLVMContext Context;
+  std::unique_ptr<Module> Result;
+  double BaseTime = 0;
+  for (unsigned Count : ThreadCounts) {
+    bool LastRun = Count == ThreadCounts.back();
+    if (Report) {
+      Report->setValue(LastRun ? ReportFile : "");
+    }
+    Result.reset();
+    std::unique_ptr<Module> M = loadModule(Context);
+
+    auto Start = std::chrono::steady_clock::now();
+    Result = fuseModule(std::move(M), Count, NumPartitions,
+                        PrintChecks && LastRun);
+    std::chrono::duration<double, std::milli> Time =
+        std::chrono::steady_clock::now() - Start;
+
+    if (ReportScaling) {
+      if (Count == ThreadCounts.front()) {
+        BaseTime = Time.count();
+        errs() << "threads  partitions  wall-time (ms)  speedup\n";
+      }
+      errs() << format("%7u  %10u  %14.1f  %6.2fx\n", Count, NumPartitions,
+                       Time.count(), BaseTime / Time.count());
+    }
+  }
+
+  if (verifyModule(*Result, &errs())) {
+    WithColor::error(errs(), "loop-fusion-driver")
+        << "fused module is broken\n";
+    return 1;
+  }
+
+  std::error_code EC;
+  ToolOutputFile Out(OutputFilename, EC,
+                     OutputAssembly ? sys::fs::OF_Text : sys::fs::OF_None);
+  if (EC) {
+    WithColor::error(errs(), "loop-fusion-driver") << EC.message() << '\n';
+    return 1;
+  }
+  if (OutputAssembly) {
+    Result->print(Out.os(), nullptr);
+  } else {
+    WriteBitcodeToFile(*Result, Out.os());
+  }
+  Out.keep();
+  return 0;
+}
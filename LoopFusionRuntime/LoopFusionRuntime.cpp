@@ -0,0 +1,111 @@
+// Runtime library of `-loop-fusion-instrument`.
+//
+// Every execution of an instrumented loop, or pair of loops, reports the cycles
+// it took and the number of iterations it ran. The totals are kept per loop
+// and written as one JSON line per location when the program exits, either to
+// stderr or appended to the file named by the LOOP_FUSION_PROFILE environment
+// variable.
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace {
+
+struct LoopTotals {
+  uint64_t Entries = 0;
+  uint64_t Trips = 0;
+  uint64_t Cycles = 0;
+};
+
+struct PointerPairHash {
+  auto operator()(const std::pair<const char *, const char *> &Key) const
+      -> size_t {
+    return std::hash<const char *>()(Key.first) * 31 +
+           std::hash<const char *>()(Key.second);
+  }
+};
+
+/// Loops are looked up by the addresses of their location and status strings,
+/// so that recording does not compare strings. The same location may still be
+/// reported from several modules, those are merged when the totals are
+/// written.
+struct Profile {
+  std::mutex Lock;
+  std::unordered_map<std::pair<const char *, const char *>, LoopTotals,
+                     PointerPairHash>
+      Loops;
+};
+
+/// The profile is never destroyed, so that loops running in destructors of
+/// static objects can still be recorded.
+auto getProfile() -> Profile & {
+  static Profile *P = new Profile;
+  return *P;
+}
+
+auto escapeJSON(const std::string &Str) -> std::string {
+  std::string Escaped;
+  for (char C : Str) {
+    if (C == '"' || C == '\\') {
+      Escaped += '\\';
+    }
+    Escaped += C;
+  }
+  return Escaped;
+}
+
+void writeProfile() {
+  Profile &P = getProfile();
+  std::lock_guard<std::mutex> Guard(P.Lock);
+
+  std::map<std::pair<std::string, std::string>, LoopTotals> Totals;
+  for (const auto &[Key, Loop] : P.Loops) {
+    LoopTotals &Merged = Totals[{Key.first, Key.second}];
+    Merged.Entries += Loop.Entries;
+    Merged.Trips += Loop.Trips;
+    Merged.Cycles += Loop.Cycles;
+  }
+
+  FILE *Out = stderr;
+  if (const char *Filename = std::getenv("LOOP_FUSION_PROFILE")) {
+    if (FILE *File = std::fopen(Filename, "a")) {
+      Out = File;
+    } else {
+      std::fprintf(stderr, "Could not open loop fusion profile %s\n", Filename);
+    }
+  }
+  for (const auto &[Key, Loop] : Totals) {
+    std::fprintf(Out,
+                 "{\"location\":\"%s\",\"status\":\"%s\",\"entries\":%" PRIu64
+                 ",\"trips\":%" PRIu64 ",\"cycles\":%" PRIu64 "}\n",
+                 escapeJSON(Key.first).c_str(), escapeJSON(Key.second).c_str(),
+                 Loop.Entries, Loop.Trips, Loop.Cycles);
+  }
+  if (Out != stderr) {
+    std::fclose(Out);
+  }
+}
+
+} // namespace
+
+/// Called by instrumented code every time a measured loop or pair of loops is
+/// left. Status tells whether it was fused, left unfused by a dry run, or
+/// belongs to a rejected candidate pair.
+extern "C" void __loop_fusion_record(const char *Location, const char *Status,
+                                     uint64_t Cycles, uint64_t Trips) {
+  static std::once_flag Registered;
+  std::call_once(Registered, [] { std::atexit(writeProfile); });
+
+  Profile &P = getProfile();
+  std::lock_guard<std::mutex> Guard(P.Lock);
+  LoopTotals &Loop = P.Loops[{Location, Status}];
+  ++Loop.Entries;
+  Loop.Trips += Trips;
+  Loop.Cycles += Cycles;
+}
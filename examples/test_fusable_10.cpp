@@ -0,0 +1,18 @@
+// Loops will be fused, since the second loop iterates over [0, n) in the
+// opposite direction and every iteration only touches its own element of B,
+// so it can be reversed first.
+int main() {
+  int A[100] = {0};
+  int B[100] = {0};
+  int n = 100;
+
+  for (int i = 0; i < n; i++) {
+    A[i] = i;
+  }
+
+  for (int j = n - 1; j >= 0; j--) {
+    B[j] = B[j] + j * 2;
+  }
+
+  return A[99] + B[0];
+}
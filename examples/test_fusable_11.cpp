@@ -0,0 +1,24 @@
+// Loops will be fused, since the second nest walks the same matrix column by
+// column. It is interchanged to walk it row by row like the first one, after
+// which the outer loops of both nests are fused.
+int main() {
+  int A[30][20] = {0};
+  int B[30][20] = {0};
+  int C[30][20] = {0};
+  int n = 30;
+  int m = 20;
+
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < m; j++) {
+      B[i][j] = A[i][j] * 2;
+    }
+  }
+
+  for (int j = 0; j < m; j++) {
+    for (int i = 0; i < n; i++) {
+      C[i][j] = A[i][j] + j;
+    }
+  }
+
+  return B[29][19] + C[29][19];
+}
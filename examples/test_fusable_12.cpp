@@ -0,0 +1,21 @@
+// Loops will be fused tile by tile when the pass is run with
+// `-loop-fusion-tile`, since the arrays do not fit into the L1 data cache. The
+// second loop reads what the first one writes in the same iteration, so every
+// tile of it runs right after the same tile of the first loop, while the
+// values are still in cache.
+int A[100000];
+int B[100000];
+
+int main() {
+  int n = 100000;
+
+  for (int i = 0; i < n; i++) {
+    A[i] = i % 7;
+  }
+
+  for (int i = 0; i < n; i++) {
+    B[i] = A[i] * 2;
+  }
+
+  return A[99999] + B[99999];
+}
@@ -0,0 +1,25 @@
+// Loops will be fused after the second nest is interchanged, like in
+// test_fusable_11.cpp. The nests skip the first row, so the loops over rows
+// start at 1 and the loops over columns at 0, and each loop of the
+// interchanged nest has to take over the start value of the other one.
+int main() {
+  int A[30][20] = {0};
+  int B[30][20] = {0};
+  int C[30][20] = {0};
+  int n = 30;
+  int m = 20;
+
+  for (int i = 1; i < n; i++) {
+    for (int j = 0; j < m; j++) {
+      B[i][j] = A[i - 1][j] + i;
+    }
+  }
+
+  for (int j = 0; j < m; j++) {
+    for (int i = 1; i < n; i++) {
+      C[i][j] = A[i][j] + j;
+    }
+  }
+
+  return B[29][19] + C[29][19] + B[0][0];
+}
@@ -0,0 +1,22 @@
+// Loops will be fused, since they work on the buffers of two different
+// vectors. The pointers returned by data() are kept in local variables, and
+// the buffer behind each of them is told apart by the vector it belongs to.
+#include <vector>
+
+int main() {
+  int n = 1000;
+  std::vector<float> A(n);
+  std::vector<float> B(n);
+  float *PA = A.data();
+  float *PB = B.data();
+
+  for (int i = 0; i < n; i++) {
+    PA[i] = i * 2.0f;
+  }
+
+  for (int i = 0; i < n; i++) {
+    PB[i] = PB[999 - i] + i;
+  }
+
+  return PA[999] + PB[3];
+}
@@ -0,0 +1,28 @@
+// Loops will be fused, since they write to different fields of the same struct
+// and to different heap allocated arrays.
+struct Points {
+  float x[100];
+  float y[100];
+};
+
+int main() {
+  Points s;
+  float *A = new float[100];
+  float *B = new float[100];
+  int n = 100;
+
+  for (int i = 0; i < n; i++) {
+    s.x[i] = i;
+    A[i] = i * 0.5f;
+  }
+
+  for (int i = 0; i < n; i++) {
+    s.y[i] = i * 2;
+    B[i] = i * 1.5f;
+  }
+
+  int result = s.x[99] + s.y[99] + A[99] + B[99];
+  delete[] A;
+  delete[] B;
+  return result % 256;
+}
@@ -0,0 +1,19 @@
+// Loops will be fused, even though the first loop iterates `n` times and the
+// second one iterates `m` times. The fused loop runs min(n, m) iterations and
+// the rest of the longer loop is executed after it.
+int main() {
+  int A[100] = {0};
+  int B[100] = {0};
+  int n = 100;
+  int m = 60;
+
+  for (int i = 0; i < n; i++) {
+    A[i] = i;
+  }
+
+  for (int i = 0; i < m; i++) {
+    B[i] = i * 2;
+  }
+
+  return A[99] + B[59];
+}
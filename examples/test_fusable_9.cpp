@@ -0,0 +1,18 @@
+// Loops will be fused, since the call to `__builtin_fabsf` does not throw,
+// always returns and does not access memory, so it cannot make the loops
+// dependent.
+int main() {
+  float A[100] = {0};
+  float B[100] = {0};
+  int n = 100;
+
+  for (int i = 0; i < n; i++) {
+    A[i] = __builtin_fabsf(i - 50.0f);
+  }
+
+  for (int i = 0; i < n; i++) {
+    B[i] = i * 2;
+  }
+
+  return A[0] + B[99];
+}
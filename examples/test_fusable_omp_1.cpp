@@ -0,0 +1,23 @@
+// Parallel regions will be fused into one, since both loops use the default
+// static schedule. No barrier is needed between them, because the second loop
+// does not read what the first one writes.
+//
+// Build with `-fopenmp` and run with `-loopfusion-omp`.
+int main() {
+  int A[1000] = {0};
+  int B[1000] = {0};
+  int C[1000] = {0};
+  int n = 1000;
+
+#pragma omp parallel for
+  for (int i = 0; i < n; i++) {
+    B[i] = A[i] + 1;
+  }
+
+#pragma omp parallel for
+  for (int i = 0; i < n; i++) {
+    C[i] = A[i] + 2;
+  }
+
+  return B[999] + C[999];
+}
@@ -0,0 +1,20 @@
+// Loops won't be fused, not even tile by tile with `-loop-fusion-tile`. Both
+// of them count with the same variable, which is reset before the second
+// loop.
+int A[100000];
+int B[100000];
+
+int main() {
+  int n = 100000;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    A[i] = i % 7;
+  }
+
+  for (i = 0; i < n; i++) {
+    B[i] = A[i] * 2;
+  }
+
+  return A[99999] + B[99999];
+}
@@ -0,0 +1,19 @@
+// Loops won't be fused, since both of them work on the same heap allocated
+// array through different pointer variables.
+int main() {
+  int *A = new int[100];
+  int *B = A;
+  int n = 100;
+
+  for (int i = 0; i < n; i++) {
+    A[i] = i;
+  }
+
+  for (int i = 0; i < n; i++) {
+    B[i] = B[99 - i] * 2;
+  }
+
+  int result = A[0];
+  delete[] A;
+  return result;
+}
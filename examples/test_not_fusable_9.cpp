@@ -0,0 +1,21 @@
+// Loops won't be fused, not even tile by tile with `-loop-fusion-tile`. The
+// code between them reads what the first loop writes, so it can't be moved
+// in front of the first loop.
+int A[100000];
+int B[100000];
+
+int main() {
+  int n = 100000;
+
+  for (int i = 0; i < n; i++) {
+    A[i] = i % 7;
+  }
+
+  int x = A[5];
+
+  for (int j = 0; j < n; j++) {
+    B[j] = A[j] * x;
+  }
+
+  return A[99999] + B[99999];
+}